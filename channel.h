@@ -0,0 +1,295 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <algorithm>
+
+#include "MPMCQueue.h"
+#include "stats.h"
+
+namespace webdataset {
+
+    // Lets threads sleep until some lock-free condition may have changed.
+    // A waiter calls prepare(), re-checks its condition, and then either
+    // cancel()s or wait()s; a producer calls notify() after changing state.
+    // notify() is a single atomic load when nobody is waiting.
+    class EventCount {
+    public:
+        uint64_t prepare() {
+            waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return epoch.load();
+        }
+        void cancel() {
+            waiters.fetch_sub(1);
+        }
+        void wait(uint64_t key) {
+            std::unique_lock<std::mutex> guard(lock);
+            while(epoch.load() == key)
+                cv.wait(guard);
+            waiters.fetch_sub(1);
+        }
+        // Returns false if the deadline passed without a notification.
+        template <class Time>
+        bool wait_until(uint64_t key, const Time &deadline) {
+            std::unique_lock<std::mutex> guard(lock);
+            bool woken = true;
+            while(woken && epoch.load() == key)
+                woken = cv.wait_until(guard, deadline) == std::cv_status::no_timeout;
+            waiters.fetch_sub(1);
+            return epoch.load() != key;
+        }
+        void notify() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(waiters.load() == 0) return;
+            notify_all();
+        }
+        void notify_all() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                epoch.fetch_add(1);
+            }
+            cv.notify_all();
+        }
+    private:
+        std::atomic<int> waiters{0};
+        std::atomic<uint64_t> epoch{0};
+        std::mutex lock;
+        std::condition_variable cv;
+    };
+
+    // Payload bytes held in all measured channels, and in other buffers
+    // that charge it, against one limit. Unlimited unless configured.
+    class MemoryBudget {
+    public:
+        void configure(size_t max_bytes) {
+            limit = max_bytes;
+            events.notify_all();
+        }
+        size_t used() const {
+            return held;
+        }
+        bool exhausted() const {
+            return held >= limit;
+        }
+        bool fits(size_t bytes) const {
+            return held + bytes <= limit;
+        }
+        bool try_acquire(size_t bytes) {
+            size_t old = held;
+            do {
+                if(old + bytes > limit) return false;
+            } while(!held.compare_exchange_weak(old, old + bytes));
+            return true;
+        }
+        // Takes bytes even beyond the limit.
+        void charge(size_t bytes) {
+            held += bytes;
+        }
+        void release(size_t bytes) {
+            held -= bytes;
+            events.notify();
+        }
+        EventCount events;
+    private:
+        std::atomic<size_t> limit{size_t(-1)};
+        std::atomic<size_t> held{0};
+    };
+
+    // Never destroyed, so that channels may outlive static destruction.
+    inline MemoryBudget &memory_budget() {
+        static MemoryBudget *budget = new MemoryBudget();
+        return *budget;
+    }
+
+    // A bounded MPMC queue whose blocking operations park the calling
+    // thread instead of spinning. After close(), push() fails and pop()
+    // returns the remaining items before failing. With set_stats(), pushes,
+    // occupancy and time spent parked are recorded. An observer is notified
+    // of every push, pop and close.
+    //
+    // Given a measure of payload bytes per item, the channel also holds at
+    // most max_bytes, and its items are charged to the memory budget. An
+    // empty channel takes any one item, so that a full budget cannot stop
+    // a pipeline.
+    template <class T>
+    class Channel {
+    public:
+        using Measure = size_t (*)(const T &);
+        explicit Channel(size_t capacity, Measure measure=nullptr)
+            : queue(capacity), capacity(capacity), measure(measure) {}
+        void set_stats(Stage *stats) {
+            this->stats = stats;
+        }
+        Stage *get_stats() const {
+            return stats;
+        }
+        void set_observer(EventCount *observer) {
+            this->observer = observer;
+        }
+        void set_max_bytes(size_t max_bytes) {
+            this->max_bytes = max_bytes;
+            pushers.notify_all();
+        }
+        // Approximate while other threads push or pop.
+        size_t size() const {
+            return std::max(queue.size(), std::ptrdiff_t(0));
+        }
+        size_t bytes() const {
+            return held;
+        }
+        bool empty() const {
+            return size() == 0;
+        }
+        // Also true while the last item refused for lack of bytes would
+        // still not fit.
+        bool full() const {
+            if(size() >= capacity) return true;
+            size_t n = rejected;
+            return held > 0 && (held + n > max_bytes || !memory_budget().fits(n) ||
+                                memory_budget().exhausted());
+        }
+        bool try_push(T &value) {
+            return admit(value) == pushed;
+        }
+        bool try_pop(T &value) {
+            if(!queue.try_pop(value)) return false;
+            if(size_t n = measure ? measure(value) : 0) {
+                held -= n;
+                memory_budget().release(n);
+            }
+            pushers.notify();
+            observe();
+            return true;
+        }
+        // Waits for room in the channel, or in the memory budget.
+        bool push(T value) {
+            for(;;) {
+                Admit result = admit(value);
+                if(result == pushed) return true;
+                if(result == refused) return false;
+                EventCount &event = result == over_budget ? memory_budget().events : pushers;
+                uint64_t key = event.prepare();
+                Admit retry = admit(value);
+                if(retry != result) {
+                    event.cancel();
+                    if(retry == pushed) return true;
+                    if(retry == refused) return false;
+                    continue;
+                }
+                auto start = std::chrono::steady_clock::now();
+                event.wait(key);
+                if(stats) stats->push_wait.add(nanoseconds_since(start));
+            }
+        }
+        bool pop(T &value) {
+            for(;;) {
+                if(try_pop(value)) return true;
+                uint64_t key = poppers.prepare();
+                if(try_pop(value)) {
+                    poppers.cancel();
+                    return true;
+                }
+                if(closed) {
+                    poppers.cancel();
+                    return try_pop(value);
+                }
+                auto start = std::chrono::steady_clock::now();
+                poppers.wait(key);
+                if(stats) stats->pop_wait.add(nanoseconds_since(start));
+            }
+        }
+        // Like pop(), but gives up after timeout seconds.
+        bool pop(T &value, double timeout) {
+            if(timeout >= 1e9) return pop(value);
+            auto deadline = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(timeout));
+            for(;;) {
+                if(try_pop(value)) return true;
+                uint64_t key = poppers.prepare();
+                if(try_pop(value)) {
+                    poppers.cancel();
+                    return true;
+                }
+                if(closed) {
+                    poppers.cancel();
+                    return try_pop(value);
+                }
+                auto start = std::chrono::steady_clock::now();
+                bool woken = poppers.wait_until(key, deadline);
+                if(stats) stats->pop_wait.add(nanoseconds_since(start));
+                if(!woken)
+                    return try_pop(value);
+            }
+        }
+        void close() {
+            closed = true;
+            pushers.notify_all();
+            poppers.notify_all();
+            if(measure) memory_budget().events.notify_all();
+            observe();
+        }
+        bool is_closed() const {
+            return closed;
+        }
+    private:
+        enum Admit { pushed, full_queue, over_budget, refused };
+        rigtorp::MPMCQueue<T> queue;
+        size_t capacity;
+        Measure measure;
+        std::atomic<size_t> max_bytes{size_t(-1)};
+        std::atomic<size_t> held{0};
+        std::atomic<size_t> rejected{0};
+        std::atomic<bool> closed{false};
+        EventCount pushers;
+        EventCount poppers;
+        Stage *stats = nullptr;
+        std::atomic<EventCount *> observer{nullptr};
+        void observe() {
+            if(EventCount *o = observer) o->notify();
+        }
+        // Bytes are reserved before the item is queued and given back if
+        // the queue turns out to be full.
+        Admit admit(T &value) {
+            if(closed) return refused;
+            size_t n = measure ? measure(value) : 0;
+            if(n > 0) {
+                size_t old = held;
+                do {
+                    if(old > 0 && old + n > max_bytes) {
+                        rejected = n;
+                        return full_queue;
+                    }
+                } while(!held.compare_exchange_weak(old, old + n));
+                if(old == 0) {
+                    memory_budget().charge(n);
+                } else if(!memory_budget().try_acquire(n)) {
+                    held -= n;
+                    rejected = n;
+                    return over_budget;
+                }
+                rejected = 0;
+            }
+            if(!queue.try_push(std::move(value))) {
+                if(n > 0) {
+                    held -= n;
+                    memory_budget().release(n);
+                }
+                return full_queue;
+            }
+            poppers.notify();
+            observe();
+            if(stats) {
+                stats->items.add(1);
+                stats->bytes.add(n);
+                stats->occupancy.record(std::max(queue.size(), std::ptrdiff_t(0)));
+            }
+            return pushed;
+        }
+    };
+
+}
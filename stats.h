@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace webdataset {
+
+    // A counter split over cache-line-sized shards picked by thread, so
+    // concurrent writers rarely share a line; value() sums the shards.
+    class Counter {
+    public:
+        void add(uint64_t n) {
+            shards[shard()].n.fetch_add(n, std::memory_order_relaxed);
+        }
+        uint64_t value() const {
+            uint64_t total = 0;
+            for(auto &s : shards)
+                total += s.n.load(std::memory_order_relaxed);
+            return total;
+        }
+    private:
+        static constexpr int nshards = 16;
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> n{0};
+        };
+        Shard shards[nshards];
+        static int shard() {
+            static std::atomic<int> next{0};
+            thread_local int index = next++ % nshards;
+            return index;
+        }
+    };
+
+    // Bucket i counts values v with 2^(i-1) <= v < 2^i; bucket 0 counts 0.
+    class Histogram {
+    public:
+        static constexpr int nbuckets = 65;
+        void record(uint64_t value) {
+            int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+            buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+            sum.add(value);
+        }
+        std::vector<uint64_t> counts() const {
+            std::vector<uint64_t> result(nbuckets);
+            for(int i=0; i<nbuckets; i++)
+                result[i] = buckets[i].load(std::memory_order_relaxed);
+            return result;
+        }
+        uint64_t total() const {
+            return sum.value();
+        }
+    private:
+        std::atomic<uint64_t> buckets[nbuckets] = {};
+        Counter sum;
+    };
+
+    // Counters for one pipeline stage or channel. Blocked times and
+    // latencies are in nanoseconds; occupancy is sampled on every push.
+    struct Stage {
+        std::string name;
+        Counter items;
+        Counter bytes;
+        Counter push_wait;
+        Counter pop_wait;
+        Histogram latency;
+        Histogram occupancy;
+    };
+
+    // Stages are created on first use and live for the whole process.
+    Stage &stage(const std::string &name);
+
+    struct StageSnapshot {
+        std::string name;
+        uint64_t items, bytes, push_wait, pop_wait;
+        std::vector<uint64_t> latency, occupancy;
+        uint64_t latency_sum, occupancy_sum;
+    };
+
+    std::vector<StageSnapshot> snapshot_stats();
+    std::string format_stats(const std::vector<StageSnapshot> &);
+    // Rewrites fname with format_stats() every interval seconds; an
+    // interval <= 0 stops the dump.
+    void dump_stats(const std::string &fname, double interval);
+
+    inline uint64_t nanoseconds_since(std::chrono::steady_clock::time_point start) {
+        auto delta = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(delta).count();
+    }
+
+}
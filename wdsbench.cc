@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "webproc.h"
+
+using namespace std;
+namespace wds = webdataset;
+namespace chrono = std::chrono;
+
+// Synthetic-shard throughput benchmark. Arguments are key=value pairs:
+//
+//   dir=/tmp/wdsbench shards=8 samples=1000 fields=3 size=10000 threads=1,2,4 batch=32
+//
+// Every result is printed to stdout as one JSON object per line.
+
+map<string, string> args{
+    {"dir", "/tmp/wdsbench"},
+    {"shards", "8"},
+    {"samples", "1000"},
+    {"fields", "3"},
+    {"size", "10000"},
+    {"threads", "1,2,4"},
+    {"batch", "32"},
+};
+
+long arg(const string &key) {
+    return stol(args[key]);
+}
+
+vector<int> arg_list(const string &key) {
+    vector<int> result;
+    stringstream stream(args[key]);
+    string item;
+    while(getline(stream, item, ','))
+        result.push_back(stoi(item));
+    return result;
+}
+
+void write_member(FILE *stream, const string &name, const string &data) {
+    char header[512];
+    memset(header, 0, sizeof header);
+    snprintf(header, 100, "%s", name.c_str());
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011zo", data.size());
+    snprintf(header + 136, 12, "%011o", 0);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    memset(header + 148, ' ', 8);
+    unsigned sum = 0;
+    for(int i=0; i<512; i++)
+        sum += (unsigned char)header[i];
+    snprintf(header + 148, 8, "%06o", sum);
+    fwrite(header, 1, sizeof header, stream);
+    fwrite(data.data(), 1, data.size(), stream);
+    static const char zeros[512] = {0};
+    fwrite(zeros, 1, (512 - data.size() % 512) % 512, stream);
+}
+
+// Member sizes vary uniformly around size so that padding is exercised.
+vector<string> make_shards() {
+    string dir = args["dir"];
+    mkdir(dir.c_str(), 0755);
+    mt19937 rng(0);
+    long size = arg("size");
+    uniform_int_distribution<long> sizes(size / 2, size + size / 2);
+    vector<string> urls;
+    for(long shard=0; shard<arg("shards"); shard++) {
+        char name[64];
+        snprintf(name, sizeof name, "/bench-%06ld.tar", shard);
+        string url = dir + name;
+        FILE *stream = fopen(url.c_str(), "wb");
+        if(!stream) throw wds::gopen_err();
+        for(long sample=0; sample<arg("samples"); sample++) {
+            char key[64];
+            snprintf(key, sizeof key, "%06ld/%08ld", shard, sample);
+            for(long field=0; field<arg("fields"); field++) {
+                string data(sizes(rng), char('a' + field));
+                write_member(stream, string(key) + ".f" + to_string(field), data);
+            }
+        }
+        static const char zeros[1024] = {0};
+        fwrite(zeros, 1, sizeof zeros, stream);
+        fclose(stream);
+        urls.push_back(url);
+    }
+    return urls;
+}
+
+struct Timer {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    chrono::steady_clock::time_point last = start;
+    vector<double> latencies;
+    size_t items = 0;
+    size_t bytes = 0;
+    void tick(size_t nbytes) {
+        auto now = chrono::steady_clock::now();
+        latencies.push_back(chrono::duration<double, micro>(now - last).count());
+        last = now;
+        items++;
+        bytes += nbytes;
+    }
+    double percentile(double p) {
+        if(latencies.empty()) return 0;
+        size_t i = min(latencies.size() - 1, size_t(p * latencies.size()));
+        nth_element(latencies.begin(), latencies.begin() + i, latencies.end());
+        return latencies[i];
+    }
+    void report(const string &bench, const string &mode, int threads) {
+        double seconds = chrono::duration<double>(last - start).count();
+        printf("{\"bench\": \"%s\", \"mode\": \"%s\", \"threads\": %d, \"items\": %zu, "
+               "\"bytes\": %zu, \"seconds\": %.6f, \"items_per_s\": %.1f, \"mb_per_s\": %.2f, "
+               "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}\n",
+               bench.c_str(), mode.c_str(), threads, items, bytes, seconds,
+               items / seconds, bytes / seconds / 1e6,
+               percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0));
+        fflush(stdout);
+    }
+};
+
+size_t view_bytes(const wds::SampleView &sample) {
+    size_t total = 0;
+    for(auto &[k, v] : sample)
+        total += v.size();
+    return total;
+}
+
+size_t sample_bytes(const wds::Sample &sample) {
+    size_t total = 0;
+    for(auto &[k, v] : sample)
+        total += v.size();
+    return total;
+}
+
+void bench_tar(const vector<string> &urls, bool use_mmap) {
+    Timer timer;
+    for(auto &url : urls) {
+        unique_ptr<wds::ITarReader> files(wds::make_TarReader(url, use_mmap));
+        while(files->peek()) {
+            timer.tick(files->data().size());
+            files->next();
+        }
+    }
+    timer.report("tar", use_mmap ? "mmap" : "stdio", 1);
+}
+
+// Header scanning only, as when building sidecar indexes.
+void bench_index(const vector<string> &urls) {
+    Timer timer;
+    for(auto &url : urls) {
+        size_t nbytes = 0;
+        for(auto &entry : wds::scan_index(url))
+            nbytes += entry.size;
+        timer.tick(nbytes);
+    }
+    timer.report("index", "scan", 1);
+}
+
+void bench_reader(const vector<string> &urls, const string &mode, bool use_mmap) {
+    unique_ptr<wds::IWebDatasetReader> reader(wds::make_WebDatasetReader());
+    reader->set_mmap(use_mmap);
+    reader->set_urls(urls);
+    Timer timer;
+    if(mode == "sample") {
+        while(auto sample = reader->next())
+            timer.tick(sample_bytes(*sample));
+    } else if(mode == "view") {
+        while(auto sample = reader->next_view())
+            timer.tick(view_bytes(*sample));
+    } else {
+        while(auto sample = reader->next_compact())
+            timer.tick(sample->bytes());
+    }
+    timer.report("reader", mode + (use_mmap ? "+mmap" : ""), 1);
+}
+
+void bench_batch(const vector<string> &urls) {
+    unique_ptr<wds::IWebDatasetReader> reader(wds::make_WebDatasetReader());
+    reader->set_urls(urls);
+    Timer timer;
+    while(auto batch = wds::next_batch(*reader, arg("batch"))) {
+        size_t nbytes = 0;
+        for(auto &[k, column] : batch->columns)
+            nbytes += column.data.size();
+        timer.tick(nbytes);
+    }
+    timer.report("batch", "view", 1);
+}
+
+void bench_writer(const vector<string> &urls, int threads) {
+    unique_ptr<wds::IWebDatasetReader> reader(wds::make_WebDatasetReader());
+    reader->set_urls(urls);
+    vector<shared_ptr<wds::Sample>> samples;
+    while(auto sample = reader->next())
+        samples.push_back(sample);
+    string pattern = args["dir"] + "/written-%06d.tar";
+    Timer timer;
+    {
+        unique_ptr<wds::IWebDatasetWriter> writer(
+            wds::make_WebDatasetWriter(pattern, size_t(-1), arg("samples"), threads));
+        for(auto &sample : samples) {
+            writer->write(sample);
+            timer.tick(sample_bytes(*sample));
+        }
+        writer->close();
+    }
+    timer.last = chrono::steady_clock::now();
+    timer.report("writer", "tar", threads);
+}
+
+void bench_parallel(const vector<string> &urls, int threads) {
+    unique_ptr<wds::IWebDatasetReader> reader(wds::make_ParallelWebDatasetReader(threads));
+    reader->set_urls(urls);
+    Timer timer;
+    while(auto sample = reader->next_view())
+        timer.tick(view_bytes(*sample));
+    timer.report("parallel", "view", threads);
+}
+
+void bench_pipeline(const vector<string> &urls, int threads, bool scheduled) {
+    unique_ptr<wds::Scheduler> scheduler;
+    if(scheduled) scheduler.reset(new wds::Scheduler(threads));
+    wds::DatasetReader dsr;
+    wds::MapProcessor<shared_ptr<wds::Sample>, size_t> sizes;
+    sizes.with([](shared_ptr<wds::Sample> sample) {
+        return sample_bytes(*sample);
+    });
+    sizes.connect(dsr);
+    dsr.set_name("bench.reader");
+    sizes.set_name("bench.sizes");
+    Timer timer;
+    if(scheduler) {
+        dsr.start(*scheduler, threads, 1);
+        sizes.start(*scheduler, threads);
+    } else {
+        dsr.start(threads);
+        sizes.start(threads);
+    }
+    for(auto url : urls)
+        dsr.add(url);
+    dsr.close();
+    size_t nbytes;
+    while(sizes.get(nbytes))
+        timer.tick(nbytes);
+    sizes.finish();
+    dsr.finish();
+    timer.report("pipeline", scheduled ? "scheduled" : "unordered", threads);
+}
+
+int main(int argc, char **argv) {
+    for(int i=1; i<argc; i++) {
+        string item = argv[i];
+        size_t eq = item.find('=');
+        if(eq == string::npos || args.count(item.substr(0, eq)) == 0) {
+            cerr << "unknown argument: " << item << "\n";
+            return 1;
+        }
+        args[item.substr(0, eq)] = item.substr(eq + 1);
+    }
+    vector<string> urls = make_shards();
+    bench_tar(urls, false);
+    bench_tar(urls, true);
+    bench_index(urls);
+    for(auto mode : {"sample", "view", "compact"}) {
+        bench_reader(urls, mode, false);
+        bench_reader(urls, mode, true);
+    }
+    bench_batch(urls);
+    for(int threads : arg_list("threads")) {
+        bench_parallel(urls, threads);
+        bench_pipeline(urls, threads, false);
+        bench_pipeline(urls, threads, true);
+        bench_writer(urls, threads);
+    }
+}
@@ -0,0 +1,31 @@
+#include "webdataset.h"
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+namespace wds = webdataset;
+
+template <class T>
+void dprint(const T &arg) {
+    cerr << arg << "\n";
+}
+
+template <class T, typename... Args>
+void dprint(const T &arg, Args... args) {
+    cerr << arg << " ";
+    dprint(args...);
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        dprint("usage:", argv[0], "shard.tar...");
+        return 1;
+    }
+    for(int i=1; i<argc; i++) {
+        string url = argv[i];
+        auto index = wds::scan_index(url);
+        wds::save_index(url, index);
+        dprint(url, index.size());
+    }
+}
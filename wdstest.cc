@@ -1,6 +1,11 @@
 #include "webdataset.h"
+#include <cstring>
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <set>
 #include <string>
+#include <unistd.h>
 
 using namespace std;
 
@@ -19,7 +24,330 @@ void dprint(const T &arg, Args... args) {
 
 string url{"imagenet-000000.tar"};
 
+int failures = 0;
+
+void check(bool ok, const string &what) {
+    if(!ok) failures++;
+    dprint(ok ? "ok" : "FAILED", what);
+}
+
+// Tar headers are built by hand so that tests can produce the variants
+// that common tools rarely write.
+void set_checksum(string &header, bool signed_sum=false) {
+    memset(&header[148], ' ', 8);
+    long sum = 0;
+    for(char c : header) sum += signed_sum ? (signed char)c : (unsigned char)c;
+    snprintf(&header[148], 8, "%06lo", sum);
+    header[155] = ' ';
+}
+
+string tar_header(const string &name, size_t size, char type='0') {
+    string header(512, '\0');
+    memcpy(&header[0], name.data(), min(name.size(), size_t(100)));
+    snprintf(&header[100], 8, "%07o", 0644);
+    snprintf(&header[108], 8, "%07o", 0);
+    snprintf(&header[116], 8, "%07o", 0);
+    snprintf(&header[124], 12, "%011zo", size);
+    snprintf(&header[136], 12, "%011o", 0);
+    header[156] = type;
+    memcpy(&header[257], "ustar", 6);
+    memcpy(&header[263], "00", 2);
+    set_checksum(header);
+    return header;
+}
+
+string pad(string data) {
+    data.resize((data.size() + 511) / 512 * 512, '\0');
+    return data;
+}
+
+string tar_member(const string &name, const string &data, char type='0') {
+    return tar_header(name, data.size(), type) + pad(data);
+}
+
+// A PAX record "<length> <key>=<value>\n", where length counts itself.
+string pax_record(const string &key, const string &value) {
+    string body = " " + key + "=" + value + "\n";
+    size_t length = body.size() + 1;
+    while(to_string(length).size() + body.size() > length) length++;
+    return to_string(length) + body;
+}
+
+vector<string> temporaries;
+
+string write_tar(const string &members) {
+    string fname = "/tmp/wdstest-" + to_string(getpid()) + "-" + to_string(temporaries.size()) + ".tar";
+    ofstream(fname, ios::binary) << members << string(1024, '\0');
+    temporaries.push_back(fname);
+    return fname;
+}
+
+// Member names and payloads of a shard, joined as "name=payload".
+vector<string> tar_contents(const string &fname) {
+    unique_ptr<wds::ITarReader> tar(wds::make_TarReader(fname));
+    vector<string> result;
+    while(auto entry = tar->peek()) {
+        result.push_back(entry->name + "=" + string(tar->data().view()));
+        tar->next();
+    }
+    return result;
+}
+
+template <class E, class F>
+bool throws(F f) {
+    try {
+        f();
+    } catch(E &) {
+        return true;
+    }
+    return false;
+}
+
+void test_headers() {
+    string header = tar_header("a.txt", 0);
+    header[124] = char(0x80);
+    memset(&header[125], 0, 10);
+    header[135] = 5;
+    set_checksum(header);
+    auto fname = write_tar(header + pad("hello"));
+    check(tar_contents(fname) == vector<string>{"a.txt=hello"}, "base-256 size");
+
+    header = tar_header("b.txt", 2);
+    header[265] = char(0xe9);
+    set_checksum(header, true);
+    fname = write_tar(header + pad("hi"));
+    check(tar_contents(fname) == vector<string>{"b.txt=hi"}, "signed checksum");
+
+    header = tar_header("c.txt", 2);
+    header[0] = 'd';
+    fname = write_tar(header + pad("hi"));
+    check(throws<wds::bad_tar_format>([&] { tar_contents(fname); }), "checksum mismatch rejected");
+
+    header = tar_header("d.txt", 2);
+    memcpy(&header[124], "         2 ", 12);
+    set_checksum(header);
+    fname = write_tar(header + pad("hi") + tar_member("e.txt", "ok"));
+    check(tar_contents(fname) == vector<string>{"d.txt=hi", "e.txt=ok"}, "blank-padded octal size");
+}
+
+void test_long_names() {
+    string name = string(120, 'n') + "/sample";
+    auto fname = write_tar(tar_member("pax", pax_record("path", name + ".txt"), 'x') +
+                           tar_member("short.txt", "a") + tar_member("next.txt", "b"));
+    check(tar_contents(fname) == vector<string>{name + ".txt=a", "next.txt=b"}, "PAX path");
+
+    unique_ptr<wds::ITarReader> tar(wds::make_TarReader(fname));
+    check(tar->peek() && tar->peek()->offset == 0, "entry starts at its extended header");
+
+    string header = tar_header("big.bin", 0);
+    fname = write_tar(tar_member("pax", pax_record("mtime", "1.5") + pax_record("size", "5"), 'x') +
+                      header + pad("hello") + tar_member("after.bin", "c"));
+    check(tar_contents(fname) == vector<string>{"big.bin=hello", "after.bin=c"}, "PAX size");
+
+    fname = write_tar(tar_member("global", pax_record("path", "all.txt"), 'g') +
+                      tar_member("one.txt", "1") + tar_member("two.txt", "2"));
+    check(tar_contents(fname) == vector<string>{"all.txt=1", "all.txt=2"}, "PAX global header");
+
+    fname = write_tar(tar_member("././@LongLink", name + ".cls" + '\0', 'L') +
+                      tar_member("trunc.cls", "7") +
+                      tar_member("././@LongLink", name + ".txt" + '\0', 'L') +
+                      tar_member("trunc.txt", "x"));
+    check(tar_contents(fname) == vector<string>{name + ".cls=7", name + ".txt=x"}, "GNU long name");
+
+    unique_ptr<wds::IWebDatasetReader> reader(wds::make_WebDatasetReader());
+    reader->set_urls({fname});
+    auto sample = reader->next();
+    check(sample && (*sample)["__key__"] == name && (*sample)[".cls"] == "7" && !reader->next(),
+          "long names group into one sample");
+
+    header = tar_header("f.txt", 1);
+    memcpy(&header[345], "dir", 3);
+    set_checksum(header);
+    fname = write_tar(header + pad("p"));
+    check(tar_contents(fname) == vector<string>{"dir/f.txt=p"}, "ustar prefix");
+}
+
+void test_shard_split() {
+    using urls = vector<string>;
+    check(wds::expand_urls("a-{008..011}.tar") == urls{"a-008.tar", "a-009.tar", "a-010.tar", "a-011.tar"},
+          "zero-padded range");
+    check(wds::expand_urls("{a,b}{1..2}") == urls{"a1", "a2", "b1", "b2"}, "repeated braces");
+    check(wds::expand_urls("x{a,b{1..2}}.tar") == urls{"xa.tar", "xb1.tar", "xb2.tar"}, "nested braces");
+    check(throws<wds::split_err>([] { wds::expand_urls("a{1..2"); }), "unbalanced brace rejected");
+
+    auto all = wds::expand_urls("s{00..10}");
+    for(bool even : {false, true}) {
+        multiset<string> seen;
+        size_t fewest = all.size(), most = 0;
+        vector<size_t> per_rank(2);
+        wds::ShardSplit split;
+        split.world_size = 2;
+        split.num_workers = 3;
+        split.seed = 5;
+        split.even = even;
+        for(split.rank = 0; split.rank < 2; split.rank++) {
+            for(split.worker_id = 0; split.worker_id < 3; split.worker_id++) {
+                auto mine = wds::split_shards(all, split, 1);
+                seen.insert(mine.begin(), mine.end());
+                fewest = min(fewest, mine.size());
+                most = max(most, mine.size());
+                per_rank[split.rank] += mine.size();
+            }
+        }
+        set<string> distinct(seen.begin(), seen.end());
+        if(even) {
+            check(distinct.size() == all.size() && fewest == most, "even split covers all shards equally");
+        } else {
+            check(seen == multiset<string>(all.begin(), all.end()), "split partitions the shards");
+            check(most - fewest <= 1 && max(per_rank[0], per_rank[1]) - min(per_rank[0], per_rank[1]) <= 1,
+                  "split balanced over consumers and ranks");
+        }
+    }
+
+    wds::ShardSplit split;
+    split.seed = 5;
+    check(wds::split_shards(all, split, 3) == wds::split_shards(all, split, 3) &&
+          wds::split_shards(all, split, 3) != wds::split_shards(all, split, 4), "split is deterministic per epoch");
+    vector<string> next;
+    auto refill = wds::shard_refill(all, split, 3);
+    refill(next);
+    check(next == wds::split_shards(all, split, 3), "refill starts at the first epoch");
+    refill(next);
+    check(next == wds::split_shards(all, split, 4), "refill advances the epoch");
+    split.rank = 1;
+    check(throws<wds::split_err>([&] { wds::split_shards(all, split, 0); }), "rank outside world rejected");
+}
+
+string samples_tar(const string &prefix, int n) {
+    string members;
+    for(int i=0; i<n; i++) members += tar_member(prefix + to_string(i) + ".txt", "x");
+    return members;
+}
+
+// The keys read from the urls, stopping at the first error.
+string read_keys(const vector<string> &urls, wds::ErrorPolicy::Action action, string *error=nullptr) {
+    unique_ptr<wds::IWebDatasetReader> reader(wds::make_WebDatasetReader());
+    wds::ErrorPolicy policy;
+    policy.action = action;
+    reader->set_error_policy(policy);
+    reader->set_urls(urls);
+    string keys;
+    try {
+        while(auto sample = reader->next()) keys += (*sample)["__key__"] + " ";
+    } catch(wds::webdataset_error &e) {
+        if(error) *error = e.what();
+    }
+    return keys;
+}
+
+void test_error_policy() {
+    using wds::ErrorPolicy;
+    string bad = tar_header("b0.txt", 1);
+    bad[0] = 'X';
+    auto good = write_tar(samples_tar("g", 2));
+    auto corrupt = write_tar(samples_tar("a", 1) + bad + pad("x") + samples_tar("c", 1));
+    auto truncated = write_tar(samples_tar("t", 1) + tar_header("t1.txt", 4096) + "short");
+    truncate(truncated.c_str(), 512 * 3);
+    string missing = "/tmp/wdstest-missing.tar";
+
+    string error;
+    check(read_keys({good, corrupt, good}, ErrorPolicy::fail, &error) == "g0 g1 " &&
+          error.find(corrupt + " at offset ") != string::npos, "fail reports shard and offset");
+    check(read_keys({good, corrupt, good}, ErrorPolicy::skip_shard) == "g0 g1 g0 g1 ",
+          "skip_shard drops a corrupt shard");
+    check(read_keys({good, corrupt, good}, ErrorPolicy::skip_member) == "g0 g1 a0 c0 g0 g1 ",
+          "skip_member resynchronizes past a corrupt header");
+    check(read_keys({truncated, good}, ErrorPolicy::skip_shard) == "t0 g0 g1 ", "skip_shard drops a truncated shard");
+    check(read_keys({missing, good}, ErrorPolicy::skip_shard) == "g0 g1 ", "skip_shard drops a missing shard");
+    error = "";
+    read_keys({missing, good}, ErrorPolicy::fail, &error);
+    check(error.find(missing) != string::npos, "fail reports a missing shard");
+}
+
+vector<string> take_keys(wds::IWebDatasetReader &reader, size_t n) {
+    vector<string> keys;
+    for(size_t i=0; i<n; i++) {
+        auto sample = reader.next();
+        if(!sample) break;
+        keys.push_back((*sample)["__key__"]);
+    }
+    return keys;
+}
+
+// Reads cut samples, checkpoints, and continues from the checkpoint in a
+// fresh reader; the first total samples must match an uninterrupted run.
+template <class Make>
+bool resumes(Make make, size_t cut, size_t total=size_t(-1)) {
+    auto full = make();
+    auto expected = take_keys(*full, total);
+    auto first = make();
+    auto keys = take_keys(*first, cut);
+    string text = wds::save_state(first->get_state());
+    auto second = make();
+    second->set_state(wds::load_state(text));
+    auto rest = take_keys(*second, total - keys.size());
+    keys.insert(keys.end(), rest.begin(), rest.end());
+    return keys == expected;
+}
+
+void test_state() {
+    auto a = write_tar(samples_tar("a", 3));
+    auto b = write_tar(samples_tar("b", 4));
+    auto plain = [&] {
+        shared_ptr<wds::IWebDatasetReader> reader(wds::make_WebDatasetReader());
+        reader->set_urls({a, b, a});
+        return reader;
+    };
+    bool ok = true;
+    for(size_t cut : {0, 1, 3, 5, 7, 9, 10}) ok = ok && resumes(plain, cut);
+    check(ok, "reader resumes from every position");
+
+    wds::ShardSplit split;
+    split.seed = 3;
+    auto split_reader = [&] {
+        shared_ptr<wds::IWebDatasetReader> reader(wds::make_WebDatasetReader());
+        reader->set_shards({a, b}, split, 0);
+        return reader;
+    };
+    auto reader = split_reader();
+    take_keys(*reader, 9);
+    check(reader->get_state().epoch == 1, "state carries the epoch");
+    ok = true;
+    for(size_t cut : {2, 7, 12}) ok = ok && resumes(split_reader, cut, 20);
+    check(ok, "reader resumes across epochs");
+
+    auto shuffled = [&] {
+        shared_ptr<wds::IWebDatasetReader> source(wds::make_WebDatasetReader());
+        source->set_urls({a, b, a});
+        return shared_ptr<wds::IWebDatasetReader>(wds::make_ShuffleReader(source, 4, 4, size_t(-1), 11));
+    };
+    ok = true;
+    for(size_t cut : {0, 2, 5, 8}) ok = ok && resumes(shuffled, cut);
+    check(ok, "shuffle resumes with its buffered samples");
+
+    wds::ReaderState state;
+    state.urls = {"x y.tar"};
+    state.current_url = "z.tar";
+    state.offset = 1536;
+    state.epoch = 2;
+    state.rng = "1 2 3";
+    state.buffered = {{"z.tar", 0}, {"w v.tar", 512}};
+    auto loaded = wds::load_state(wds::save_state(state));
+    check(loaded.urls == state.urls && loaded.current_url == state.current_url &&
+          loaded.offset == state.offset && loaded.epoch == state.epoch && loaded.rng == state.rng &&
+          loaded.buffered == state.buffered, "state text round trip");
+    check(throws<wds::state_err>([] { wds::load_state("offset x\n"); }), "bad state text rejected");
+    unique_ptr<wds::IWebDatasetReader> parallel(wds::make_ParallelWebDatasetReader(2));
+    check(throws<wds::state_err>([&] { parallel->get_state(); }), "parallel reader has no state");
+}
+
 int main() {
+    test_headers();
+    test_long_names();
+    test_shard_split();
+    test_error_policy();
+    test_state();
+
     unique_ptr<wds::IWebDatasetReader> wds;
     wds.reset(wds::make_WebDatasetReader());
     int countdown = 3;
@@ -38,4 +366,8 @@ int main() {
         }
         dprint(i, (*sample)["__key__"], keys);
     }
+
+    for(auto &fname : temporaries) unlink(fname.c_str());
+    if(failures > 0) dprint(failures, "checks failed");
+    return failures > 0;
 }
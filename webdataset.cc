@@ -1,30 +1,58 @@
 #include "webdataset.h"
 
 #include <unistd.h>
-#include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <linux/io_uring.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef WDS_ZSTD
+#include <zstd.h>
+#endif
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <math.h>
 
 #include <iostream>
 #include <set>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <exception>
 #include <queue>
 #include <deque>
-#include <regex>
 #include <thread>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <future>
+#include <condition_variable>
+#include <chrono>
+
+#include "channel.h"
 
 namespace webdataset {
 
     using namespace std;
 
+    struct Mapping;
+
     using Stdio = std::shared_ptr<FILE>;
-    using Tarfile = std::pair<std::string, std::string>;
+    using Mmap = std::shared_ptr<Mapping>;
     using Refill = void(*)(std::vector<std::string> &);
 
     Stdio gopen(const std::string &);
+    Stdio zopen(const std::string &);
+    Stdio uring_open(const std::string &);
+    Mmap mopen(const std::string &);
 
     struct posix_header {           /* byte offset */
         char name[100];               /*   0 */
@@ -75,171 +103,2852 @@ namespace webdataset {
         return result;
     }
 
+    IOBackend io_backend = IOBackend::stdio;
+    size_t io_chunk_size = 1 << 20;
+    int io_depth = 4;
+
+    void set_io_backend(IOBackend backend, size_t chunk_size, int depth) {
+        io_backend = backend;
+        io_chunk_size = max(chunk_size, size_t(4096));
+        io_depth = max(depth, 1);
+    }
+
+    map<string, unique_ptr<Stage>> &stage_registry() {
+        static map<string, unique_ptr<Stage>> stages;
+        return stages;
+    }
+
+    mutex &stage_lock() {
+        static mutex lock;
+        return lock;
+    }
+
+    Stage &stage(const string &name) {
+        lock_guard<mutex> guard(stage_lock());
+        auto &slot = stage_registry()[name];
+        if(!slot) {
+            slot.reset(new Stage());
+            slot->name = name;
+        }
+        return *slot;
+    }
+
+    vector<StageSnapshot> snapshot_stats() {
+        lock_guard<mutex> guard(stage_lock());
+        vector<StageSnapshot> result;
+        for(auto &[name, s] : stage_registry()) {
+            result.push_back(StageSnapshot{
+                name, s->items.value(), s->bytes.value(), s->push_wait.value(), s->pop_wait.value(),
+                s->latency.counts(), s->occupancy.counts(), s->latency.total(), s->occupancy.total()});
+        }
+        return result;
+    }
+
+    // Upper bound of the histogram bucket containing the p-th quantile.
+    double quantile(const vector<uint64_t> &counts, double p) {
+        uint64_t total = 0;
+        for(auto n : counts) total += n;
+        if(total == 0) return 0;
+        uint64_t seen = 0;
+        for(size_t i=0; i<counts.size(); i++) {
+            seen += counts[i];
+            if(seen >= p * total) return i == 0 ? 0 : ldexp(1.0, i);
+        }
+        return ldexp(1.0, counts.size());
+    }
+
+    string format_stats(const vector<StageSnapshot> &stages) {
+        string result = "{";
+        char buffer[512];
+        for(size_t i=0; i<stages.size(); i++) {
+            auto &s = stages[i];
+            uint64_t samples = 0, pushes = 0;
+            for(auto n : s.latency) samples += n;
+            for(auto n : s.occupancy) pushes += n;
+            snprintf(buffer, sizeof buffer,
+                     "%s\n  \"%s\": {\"items\": %lu, \"bytes\": %lu, "
+                     "\"push_wait_s\": %.6f, \"pop_wait_s\": %.6f, "
+                     "\"latency_mean_us\": %.2f, \"latency_p50_us\": %.2f, \"latency_p99_us\": %.2f, "
+                     "\"occupancy_mean\": %.2f, \"occupancy_p99\": %.0f}",
+                     i > 0 ? "," : "", quote(s.name).c_str(),
+                     (unsigned long)s.items, (unsigned long)s.bytes,
+                     s.push_wait / 1e9, s.pop_wait / 1e9,
+                     samples ? s.latency_sum / 1e3 / samples : 0.0,
+                     quantile(s.latency, 0.5) / 1e3, quantile(s.latency, 0.99) / 1e3,
+                     pushes ? double(s.occupancy_sum) / pushes : 0.0,
+                     quantile(s.occupancy, 0.99));
+            result += buffer;
+        }
+        result += "\n}\n";
+        return result;
+    }
+
+    class StatsDumper {
+    private:
+        mutex lock;
+        condition_variable changed;
+        thread worker;
+        string fname;
+        double interval = 0;
+        void write() {
+            string tmp = fname + ".tmp";
+            FILE *stream = fopen(tmp.c_str(), "w");
+            if(!stream) return;
+            string text = format_stats(snapshot_stats());
+            fwrite(text.data(), 1, text.size(), stream);
+            if(fclose(stream) == 0) rename(tmp.c_str(), fname.c_str());
+        }
+        void run() {
+            unique_lock<mutex> guard(lock);
+            while(interval > 0) {
+                changed.wait_for(guard, chrono::duration<double>(interval));
+                if(interval > 0) write();
+            }
+        }
+    public:
+        void start(const string &fname, double interval) {
+            stop();
+            if(interval <= 0) return;
+            this->fname = fname;
+            this->interval = interval;
+            worker = thread(&StatsDumper::run, this);
+        }
+        void stop() {
+            {
+                lock_guard<mutex> guard(lock);
+                interval = 0;
+            }
+            changed.notify_all();
+            if(worker.joinable()) worker.join();
+        }
+        ~StatsDumper() {
+            stop();
+        }
+    };
+
+    void dump_stats(const string &fname, double interval) {
+        static StatsDumper dumper;
+        dumper.start(fname, interval);
+    }
+
+    Stage &open_stats = stage("open");
+    Stage &tar_stats = stage("tar");
+    Stage &sample_stats = stage("samples");
+    Stage &error_stats = stage("errors");
+
+    string shell_quote(const string &s) {
+        string quoted = "'";
+        for(char c : s) {
+            if(c == '\'') quoted += "'\\''";
+            else quoted += c;
+        }
+        return quoted + "'";
+    }
+
+    bool ends_with(const string &s, const string &suffix) {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // Compressed shards are recognized by extension and decompressed
+    // in-process; they cannot be memory-mapped or seeked.
+    bool is_compressed(const string &fname) {
+        if(fname.find("pipe:") == 0) return false;
+        return ends_with(fname, ".gz") || ends_with(fname, ".tgz") ||
+            ends_with(fname, ".zst") || ends_with(fname, ".tzst");
+    }
+
     Stdio gopen(const string &fname) {
+        if(is_compressed(fname)) return zopen(fname);
         if(fname.find("pipe:") == 0) {
-            FILE *stream = popen(fname.c_str(), "rb");
+            FILE *stream = popen(fname.substr(5).c_str(), "r");
             if(!stream) throw gopen_err();
             return Stdio(stream, pclose);
         }
+        if(io_backend == IOBackend::uring) {
+            Stdio stream = uring_open(fname);
+            if(stream) return stream;
+        }
         FILE *stream = fopen(fname.c_str(), "rb");
         if(!stream) throw gopen_err();
         return Stdio(stream, fclose);
     }
 
-    const regex splitext_re(R"(([^/.]*|.*/[^/.]*)(\.[^/]*|))");
+    struct Mapping {
+        const char *data = nullptr;
+        size_t size = 0;
+        ~Mapping() {
+            if(data) munmap((void *)data, size);
+        }
+    };
+
+    Mmap mopen(const string &fname) {
+        int fd = open(fname.c_str(), O_RDONLY);
+        if(fd < 0) throw gopen_err();
+        struct stat st;
+        if(fstat(fd, &st) < 0) {
+            close(fd);
+            throw gopen_err();
+        }
+        auto mapping = make_shared<Mapping>();
+        if(st.st_size > 0) {
+            void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(addr == MAP_FAILED) {
+                close(fd);
+                throw gopen_err();
+            }
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            mapping->data = (const char *)addr;
+            mapping->size = st.st_size;
+        }
+        close(fd);
+        return mapping;
+    }
+
+    // Decompressors are wrapped in a FILE* with fopencookie so that
+    // FileReader sees an ordinary stream. Errors surface as short reads.
 
-    auto splitext(string s) {
-        auto groups = smatch{};
-        assert(regex_match(s, groups, splitext_re));
-        string base = groups[1];
-        string ext = groups[2];
-        return make_tuple(base, ext);
+    ssize_t gz_read(void *cookie, char *buf, size_t size) {
+        return gzread((gzFile)cookie, buf, unsigned(min(size, size_t(1) << 30)));
     }
 
-    class FileReader {
-    private:
-        Stdio stream;
-        shared_ptr<Tarfile> item;
-    public:
-        FileReader() = default;
-        void set_stream(Stdio stream) {
-            this->stream = stream;
-            item = nullptr;
+    int gz_close(void *cookie) {
+        return gzclose((gzFile)cookie) == Z_OK ? 0 : -1;
+    }
+
+    Stdio gz_open(const string &fname) {
+        gzFile gz = gzopen(fname.c_str(), "rb");
+        if(!gz) throw gopen_err();
+        gzbuffer(gz, 1 << 17);
+        cookie_io_functions_t io{gz_read, nullptr, nullptr, gz_close};
+        FILE *stream = fopencookie(gz, "r", io);
+        if(!stream) {
+            gzclose(gz);
+            throw gopen_err();
         }
-        bool fetch() {
-            item = nullptr;
-            if(feof(stream.get())) return false;
-            while(!feof(stream.get())) {
-                posix_header header;
-                int n1 = fread((char *)&header, 1, sizeof header, stream.get());
-                if(n1 != sizeof header) throw bad_tar_format();
-                if(header.typeflag == '\0') break;
-                item = make_shared<Tarfile>();
-                item->first = string(header.prefix) + string(header.name);
-                int size = stoi(string(header.size, 12), nullptr, 8);
-                int blocks = (size + 511) / 512;
-                int rounded = blocks * 512;
-                if(rounded > 0) {
-                    item->second.resize(rounded, '_');
-                    int n2 = fread((char *)&item->second[0], 1, rounded, stream.get());
-                    if(n2 != rounded) throw bad_tar_format();
-                    item->second.resize(size);
-                }
-                if(header.typeflag != '0') continue;
-                return true;
-            }
-            return false;
+        return Stdio(stream, fclose);
+    }
+
+#ifdef WDS_ZSTD
+    // Shards made of several zstd frames are decoded a few frames ahead
+    // on worker threads; single-frame shards are decoded as a stream.
+    struct ZstdCookie {
+        Mmap mapping;
+        vector<pair<size_t, size_t>> frames;
+        size_t next_frame = 0;
+        size_t ahead = 1;
+        deque<future<string>> decoded;
+        string current;
+        size_t pos = 0;
+        ZSTD_DCtx *ctx = nullptr;
+        ZSTD_inBuffer input{nullptr, 0, 0};
+        ~ZstdCookie() {
+            decoded.clear();
+            if(ctx) ZSTD_freeDCtx(ctx);
         }
-        shared_ptr<Tarfile> next() {
-            if(!item) fetch();
-            shared_ptr<Tarfile> result = item;
-            fetch();
+    };
+
+    string zstd_frame(const char *data, size_t size) {
+        string result;
+        unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx *)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        unsigned long long n = ZSTD_getFrameContentSize(data, size);
+        if(n != ZSTD_CONTENTSIZE_UNKNOWN && n != ZSTD_CONTENTSIZE_ERROR) {
+            result.resize(n);
+            size_t r = ZSTD_decompressDCtx(ctx.get(), &result[0], n, data, size);
+            if(ZSTD_isError(r) || r != n) throw bad_tar_format();
             return result;
         }
-        shared_ptr<Tarfile> peek() {
-            if(!item) fetch();
-            return item;
+        ZSTD_inBuffer in{data, size, 0};
+        vector<char> chunk(ZSTD_DStreamOutSize());
+        while(in.pos < in.size) {
+            ZSTD_outBuffer out{chunk.data(), chunk.size(), 0};
+            size_t r = ZSTD_decompressStream(ctx.get(), &out, &in);
+            if(ZSTD_isError(r)) throw bad_tar_format();
+            result.append(chunk.data(), out.pos);
         }
-    };
+        return result;
+    }
 
+    ssize_t zstd_read(void *cookie, char *buf, size_t size) {
+        auto z = (ZstdCookie *)cookie;
+        try {
+            if(z->ctx) {
+                ZSTD_outBuffer out{buf, size, 0};
+                while(out.pos == 0 && z->input.pos < z->input.size) {
+                    size_t r = ZSTD_decompressStream(z->ctx, &out, &z->input);
+                    if(ZSTD_isError(r)) return -1;
+                }
+                return out.pos;
+            }
+            while(z->pos == z->current.size()) {
+                while(z->decoded.size() < z->ahead && z->next_frame < z->frames.size()) {
+                    auto [start, length] = z->frames[z->next_frame++];
+                    const char *data = z->mapping->data + start;
+                    z->decoded.push_back(async(launch::async, zstd_frame, data, length));
+                }
+                if(z->decoded.empty()) return 0;
+                z->current = z->decoded.front().get();
+                z->decoded.pop_front();
+                z->pos = 0;
+            }
+            size_t n = min(size, z->current.size() - z->pos);
+            memcpy(buf, z->current.data() + z->pos, n);
+            z->pos += n;
+            return n;
+        } catch(...) {
+            return -1;
+        }
+    }
 
-    class SampleReader {
+    int zstd_close(void *cookie) {
+        delete (ZstdCookie *)cookie;
+        return 0;
+    }
+
+    Stdio zstd_open(const string &fname) {
+        auto z = make_unique<ZstdCookie>();
+        z->mapping = mopen(fname);
+        const char *data = z->mapping->data;
+        size_t size = z->mapping->size;
+        for(size_t offset = 0; offset < size; ) {
+            size_t length = ZSTD_findFrameCompressedSize(data + offset, size - offset);
+            if(ZSTD_isError(length)) throw bad_tar_format();
+            z->frames.emplace_back(offset, length);
+            offset += length;
+        }
+        if(z->frames.size() <= 1) {
+            z->ctx = ZSTD_createDCtx();
+            z->input = ZSTD_inBuffer{data, size, 0};
+        }
+        z->ahead = max(1u, min(4u, thread::hardware_concurrency()));
+        cookie_io_functions_t io{zstd_read, nullptr, nullptr, zstd_close};
+        FILE *stream = fopencookie(z.get(), "r", io);
+        if(!stream) throw gopen_err();
+        z.release();
+        return Stdio(stream, fclose);
+    }
+#else
+    // Without libzstd, fall back to an external decompressor.
+    Stdio zstd_open(const string &fname) {
+        return gopen("pipe:zstd -dc -- " + shell_quote(fname));
+    }
+#endif
+
+    // A minimal io_uring submission/completion ring over the raw syscalls.
+    class Uring {
     private:
-        shared_ptr<FileReader> source;
-        shared_ptr<Sample> item;
+        int ring = -1;
+        void *sq_ptr = MAP_FAILED;
+        void *cq_ptr = MAP_FAILED;
+        size_t sq_size = 0;
+        size_t cq_size = 0;
+        io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+        size_t sqes_size = 0;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        io_uring_cqe *cqes;
+        unsigned pending = 0;
+        void release() {
+            if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+            if(cq_ptr != MAP_FAILED) munmap(cq_ptr, cq_size);
+            if(sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+            if(ring >= 0) close(ring);
+        }
     public:
-        SampleReader() = default;
-        void set_source(shared_ptr<FileReader> source) {
-            this->source = source;
-            item = nullptr;
+        explicit Uring(unsigned entries) {
+            io_uring_params params;
+            memset(&params, 0, sizeof params);
+            ring = syscall(__NR_io_uring_setup, entries, &params);
+            if(ring < 0) throw gopen_err();
+            sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring, IORING_OFF_SQ_RING);
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring, IORING_OFF_CQ_RING);
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+            if(sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+                release();
+                throw gopen_err();
+            }
+            char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+            sq_tail = (unsigned *)(sq + params.sq_off.tail);
+            sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+            sq_array = (unsigned *)(sq + params.sq_off.array);
+            cq_head = (unsigned *)(cq + params.cq_off.head);
+            cq_tail = (unsigned *)(cq + params.cq_off.tail);
+            cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
         }
-        bool fetch() {
-            item = nullptr;
-            string key = "";
+        ~Uring() {
+            release();
+        }
+        bool register_buffers(const vector<iovec> &buffers) {
+            return syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS,
+                           buffers.data(), buffers.size()) == 0;
+        }
+        // Queues a read; buffer < 0 means the buffer is not registered.
+        void read(int fd, char *dst, size_t size, size_t offset, int buffer, uint64_t tag) {
+            unsigned tail = *sq_tail;
+            unsigned index = tail & *sq_mask;
+            io_uring_sqe &sqe = sqes[index];
+            memset(&sqe, 0, sizeof sqe);
+            sqe.opcode = buffer >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe.fd = fd;
+            sqe.addr = (uint64_t)dst;
+            sqe.len = size;
+            sqe.off = offset;
+            sqe.buf_index = buffer >= 0 ? buffer : 0;
+            sqe.user_data = tag;
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            pending++;
+        }
+        // Submits queued reads and waits for one completion.
+        bool wait(uint64_t &tag, int &result) {
             for(;;) {
-                auto file = source->peek();
-                if(!file) return bool(item);
-                auto [base, ext] = splitext(file->first);
-                assert(base != "");
-                if(key=="") {
-                    key = base;
-                    item = make_shared<Sample>();
-                    (*item)["__key__"s] = key;
-                }
-                if(key!=base) {
+                unsigned head = *cq_head;
+                if(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                    io_uring_cqe &cqe = cqes[head & *cq_mask];
+                    tag = cqe.user_data;
+                    result = cqe.res;
+                    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
                     return true;
                 }
-                (*item)[ext] = file->second;
-                source->next();
+                int n = syscall(__NR_io_uring_enter, ring, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if(n < 0 && errno != EINTR) return false;
+                if(n > 0) pending -= min(unsigned(n), pending);
             }
         }
-        shared_ptr<Sample> next() {
-            if(!item) fetch();
-            shared_ptr<Sample> result = item;
-            fetch();
-            return result;
+    };
+
+    // Streams a local file through a ring of large reads: depth chunks of
+    // chunk_size bytes are kept in flight into registered buffers, and
+    // FileReader parses headers straight out of the completed chunks.
+    struct UringCookie {
+        int fd = -1;
+        size_t file_size = 0;
+        size_t chunk_size;
+        int depth;
+        Uring ring;
+        bool fixed = false;
+        vector<unique_ptr<char[]>> buffers;
+        vector<int> results;
+        vector<bool> busy;
+        size_t current = 0;
+        size_t pos = 0;
+        UringCookie(int fd, size_t file_size, size_t chunk_size, int depth)
+            : fd(fd), file_size(file_size), chunk_size(chunk_size), depth(depth),
+              ring(depth), results(depth, -1), busy(depth, false) {
+            vector<iovec> iovecs;
+            for(int i=0; i<depth; i++) {
+                buffers.emplace_back(new char[chunk_size]);
+                iovecs.push_back(iovec{buffers.back().get(), chunk_size});
+            }
+            fixed = ring.register_buffers(iovecs);
         }
-        shared_ptr<Sample> peek() {
-            if(!item) fetch();
-            return item;
+        ~UringCookie() {
+            drain();
+            close(fd);
+        }
+        int slot(size_t chunk) {
+            return chunk % depth;
+        }
+        void submit(size_t chunk) {
+            size_t offset = chunk * chunk_size;
+            if(offset >= file_size) return;
+            int i = slot(chunk);
+            size_t size = min(chunk_size, file_size - offset);
+            ring.read(fd, buffers[i].get(), size, offset, fixed ? i : -1, i);
+            busy[i] = true;
+        }
+        bool complete(int i) {
+            while(busy[i]) {
+                uint64_t tag;
+                int result;
+                if(!ring.wait(tag, result)) return false;
+                busy[tag] = false;
+                results[tag] = result;
+            }
+            return true;
+        }
+        void drain() {
+            for(int i=0; i<depth; i++)
+                complete(i);
+        }
+        void restart(size_t position) {
+            drain();
+            current = position / chunk_size;
+            pos = position % chunk_size;
+            for(int i=0; i<depth; i++)
+                submit(current + i);
         }
     };
 
+    ssize_t uring_read(void *cookie, char *buf, size_t size) {
+        auto u = (UringCookie *)cookie;
+        size_t total = 0;
+        while(total < size && u->current * u->chunk_size < u->file_size) {
+            int i = u->slot(u->current);
+            if(!u->complete(i)) return -1;
+            int result = u->results[i];
+            size_t expected = min(u->chunk_size, u->file_size - u->current * u->chunk_size);
+            if(result < 0 || size_t(result) != expected) return total > 0 ? total : -1;
+            size_t n = min(size - total, size_t(result) - u->pos);
+            memcpy(buf + total, u->buffers[i].get() + u->pos, n);
+            total += n;
+            u->pos += n;
+            if(u->pos == size_t(result)) {
+                u->pos = 0;
+                u->submit(u->current + u->depth);
+                u->current++;
+            }
+        }
+        return total;
+    }
 
-    class WebDatasetReader : public IWebDatasetReader {
-    private:
-        vector<string> urls;
-        string current_url;
-        Stdio stream;
-        shared_ptr<FileReader> files;
-        shared_ptr<SampleReader> samples;
-        function<void(vector<string> &)> refill = [](vector<string> &){};
-    public:
-        WebDatasetReader() = default;
-        void add_url(const string &url) {
-            urls.push_back(url);
+    int uring_seek(void *cookie, off64_t *offset, int whence) {
+        auto u = (UringCookie *)cookie;
+        off64_t position = u->current * u->chunk_size + u->pos;
+        if(whence == SEEK_SET) position = *offset;
+        else if(whence == SEEK_CUR) position += *offset;
+        else if(whence == SEEK_END) position = u->file_size + *offset;
+        else return -1;
+        if(position < 0) return -1;
+        if(size_t(position) / u->chunk_size == u->current) {
+            u->pos = position % u->chunk_size;
+        } else {
+            u->restart(position);
         }
-        void set_urls(const vector<string> &urls) {
-            this->urls = urls;
-            stream = nullptr;
-            files = nullptr;
-            samples = nullptr;
+        *offset = position;
+        return 0;
+    }
+
+    int uring_close(void *cookie) {
+        delete (UringCookie *)cookie;
+        return 0;
+    }
+
+    // Returns nullptr if io_uring is unavailable, so gopen can fall back.
+    Stdio uring_open(const string &fname) {
+        int fd = open(fname.c_str(), O_RDONLY);
+        if(fd < 0) throw gopen_err();
+        struct stat st;
+        if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return nullptr;
         }
-        void set_refill(function<void(vector<string> &)> refill) {
-            this->refill = refill;
+        UringCookie *u;
+        try {
+            u = new UringCookie(fd, st.st_size, io_chunk_size, io_depth);
+        } catch(gopen_err &) {
+            close(fd);
+            return nullptr;
         }
-        bool next_url() {
-            if(urls.size() == 0)
-                refill(urls);
-            if(urls.size() == 0) 
-                return false;
-            current_url = urls[0];
-            urls.pop_back();
-            stream = gopen(current_url);
-            files.reset(new FileReader());
-            files->set_stream(stream);
-            samples.reset(new SampleReader());
-            samples->set_source(files);
-            return true;
+        u->restart(0);
+        cookie_io_functions_t io{uring_read, nullptr, uring_seek, uring_close};
+        FILE *stream = fopencookie(u, "r", io);
+        if(!stream) {
+            delete u;
+            throw gopen_err();
         }
-        bool forward() {
-            while(!samples || !samples->peek()) {
-                if(!next_url())
-                    return  false;
+        setvbuf(stream, nullptr, _IONBF, 0);
+        return Stdio(stream, fclose);
+    }
+
+    Stdio zopen(const string &fname) {
+        if(ends_with(fname, ".zst") || ends_with(fname, ".tzst"))
+            return zstd_open(fname);
+        return gz_open(fname);
+    }
+
+    // Values from PAX ('x', 'g') and GNU long-name ('L') headers that
+    // replace the fields of the ustar header they apply to.
+    struct Overrides {
+        bool has_name = false;
+        bool has_size = false;
+        string name;
+        uint64_t size = 0;
+    };
+
+    // Applies the "path" and "size" records of a PAX extended header, whose
+    // records have the form "<length> <key>=<value>\n".
+    void parse_pax(string_view data, Overrides &result) {
+        while(data.size() > 0) {
+            size_t space = data.find(' ');
+            if(space == string_view::npos) throw bad_tar_format();
+            size_t length = 0;
+            for(size_t i=0; i<space; i++) {
+                if(data[i] < '0' || data[i] > '9') throw bad_tar_format();
+                length = length * 10 + (data[i] - '0');
+            }
+            if(length <= space + 1 || length > data.size() || data[length - 1] != '\n')
+                throw bad_tar_format();
+            string_view record = data.substr(space + 1, length - space - 2);
+            data.remove_prefix(length);
+            size_t eq = record.find('=');
+            if(eq == string_view::npos) throw bad_tar_format();
+            string_view key = record.substr(0, eq), value = record.substr(eq + 1);
+            if(key == "path") {
+                result.name = value;
+                result.has_name = true;
+            } else if(key == "size") {
+                result.size = 0;
+                for(char c : value) {
+                    if(c < '0' || c > '9') throw bad_tar_format();
+                    result.size = result.size * 10 + (c - '0');
+                }
+                result.has_size = true;
+            }
+        }
+    }
+
+    // Splits "dir/a.b.c" into "dir/a" and ".b.c": the extension starts at
+    // the first dot of the last path component. The views point into s.
+    pair<string_view, string_view> splitext(string_view s) {
+        size_t slash = s.rfind('/');
+        size_t dot = s.find('.', slash == string_view::npos ? 0 : slash + 1);
+        if(dot == string_view::npos) return {s, string_view()};
+        return {s.substr(0, dot), s.substr(dot)};
+    }
+
+    // Parses a numeric header field: octal digits after optional leading
+    // blanks, or a GNU base-256 big-endian number when the top bit of the
+    // first byte is set. Returns false for negative or unparseable values.
+    bool parse_number(const char *field, size_t n, uint64_t &value) {
+        auto bytes = (const unsigned char *)field;
+        value = 0;
+        if(bytes[0] & 0x80) {
+            if(bytes[0] & 0x40) return false;
+            value = bytes[0] & 0x3f;
+            for(size_t i=1; i<n; i++) {
+                if(value >> 56) return false;
+                value = (value << 8) | bytes[i];
             }
             return true;
         }
-        shared_ptr<Sample> peek() {
-            forward();
-            return samples->peek();
+        size_t i = 0;
+        while(i < n && (field[i] == ' ' || field[i] == '\0')) i++;
+        size_t start = i;
+        for(; i < n && field[i] >= '0' && field[i] <= '7'; i++)
+            value = (value << 3) | (field[i] - '0');
+        return i > start;
+    }
+
+    bool is_zero_block(const posix_header &header) {
+        auto bytes = (const char *)&header;
+        return bytes[0] == 0 && memcmp(bytes, bytes + 1, sizeof header - 1) == 0;
+    }
+
+    // The sum of n bytes and the number of them with the top bit set; the
+    // signed-char sum is sum - 256 * high.
+    struct ByteSums {
+        uint64_t sum = 0;
+        uint64_t high = 0;
+    };
+
+    ByteSums byte_sums_scalar(const unsigned char *bytes, size_t n) {
+        ByteSums result;
+        for(size_t i=0; i<n; i++) {
+            result.sum += bytes[i];
+            result.high += bytes[i] >> 7;
         }
-        shared_ptr<Sample> next() {
-            forward();
-            return samples->next();
+        return result;
+    }
+
+#if defined(__x86_64__)
+    // SAD against zero sums each group of eight bytes; the movemask picks
+    // out the top bits. n must be a multiple of 16 (32 for AVX2).
+    ByteSums byte_sums_sse2(const unsigned char *bytes, size_t n) {
+        __m128i zero = _mm_setzero_si128(), sums = zero;
+        ByteSums result;
+        for(size_t i=0; i<n; i+=16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+            sums = _mm_add_epi64(sums, _mm_sad_epu8(v, zero));
+            result.high += __builtin_popcount(_mm_movemask_epi8(v));
+        }
+        sums = _mm_add_epi64(sums, _mm_unpackhi_epi64(sums, sums));
+        result.sum = _mm_cvtsi128_si64(sums);
+        return result;
+    }
+
+    __attribute__((target("avx2,popcnt")))
+    ByteSums byte_sums_avx2(const unsigned char *bytes, size_t n) {
+        __m256i zero = _mm256_setzero_si256(), sums = zero;
+        ByteSums result;
+        for(size_t i=0; i<n; i+=32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+            sums = _mm256_add_epi64(sums, _mm256_sad_epu8(v, zero));
+            result.high += __builtin_popcount(unsigned(_mm256_movemask_epi8(v)));
+        }
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+        result.sum = _mm_cvtsi128_si64(half);
+        return result;
+    }
+#endif
+
+    using ByteSumsFn = ByteSums (*)(const unsigned char *, size_t);
+
+    // SSE2 is part of x86-64; AVX2 is used where the CPU has it.
+    ByteSumsFn pick_byte_sums() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) return byte_sums_avx2;
+        return byte_sums_sse2;
+#else
+        return byte_sums_scalar;
+#endif
+    }
+
+    const ByteSumsFn block_sums = pick_byte_sums();
+
+    // The checksum is the sum of all header bytes with the checksum field
+    // counted as blanks; some old writers summed signed chars.
+    bool valid_checksum(const posix_header &header) {
+        uint64_t expected;
+        if(!parse_number(header.chksum, sizeof header.chksum, expected)) return false;
+        auto bytes = (const unsigned char *)&header;
+        ByteSums all = block_sums(bytes, sizeof header);
+        ByteSums field = byte_sums_scalar((const unsigned char *)header.chksum, sizeof header.chksum);
+        uint64_t sum = all.sum - field.sum + ' ' * sizeof header.chksum;
+        uint64_t signed_sum = sum - 256 * (all.high - field.high);
+        return sum == expected || signed_sum == expected;
+    }
+
+    void CompactSample::reserve(size_t size) {
+        if(size <= capacity) return;
+        unique_ptr<char[]> grown(new char[size]);
+        if(used > 0) memcpy(grown.get(), arena.get(), used);
+        arena = move(grown);
+        capacity = size;
+    }
+
+    char *CompactSample::allocate(size_t size) {
+        if(used + size > capacity)
+            reserve(max(used + size, 2 * capacity));
+        char *result = arena.get() + used;
+        used += size;
+        return result;
+    }
+
+    void CompactSample::set_key(string_view key) {
+        size_t start = used;
+        memcpy(allocate(key.size()), key.data(), key.size());
+        key_field = Span{start, key.size()};
+    }
+
+    char *CompactSample::append(string_view ext, size_t size) {
+        size_t start = used;
+        memcpy(allocate(ext.size()), ext.data(), ext.size());
+        Field field{Span{start, ext.size()}, Span{used, size}};
+        if(nfields < ninline) {
+            inline_fields[nfields] = field;
+        } else {
+            extra_fields.push_back(field);
+        }
+        nfields++;
+        return allocate(size);
+    }
+
+    void CompactSample::add(string_view ext, string_view data) {
+        char *dst = append(ext, data.size());
+        if(data.size() > 0) memcpy(dst, data.data(), data.size());
+    }
+
+    bool CompactSample::find(string_view ext, string_view &data) const {
+        for(size_t i=0; i<nfields; i++) {
+            if(name(i) == ext) {
+                data = this->data(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    shared_ptr<CompactSample> to_compact(shared_ptr<SampleView> view) {
+        if(!view) return nullptr;
+        size_t total = 0;
+        for(auto &[k, v] : *view)
+            total += k.size() + v.size();
+        auto result = make_shared<CompactSample>();
+        result->reserve(total);
+        for(auto &[k, v] : *view) {
+            if(k == "__key__")
+                result->set_key(v);
+            else
+                result->add(k, v);
+        }
+        return result;
+    }
+
+    Stage &pool_stats = stage("pool");
+
+    // Pooled bytes the current thread holds on to while it allocates more,
+    // such as the members of a sample being assembled or a shuffle buffer.
+    thread_local size_t pinned_bytes = 0;
+
+    // Free lists of power-of-two size classes from 4 KB to 64 MB; larger
+    // buffers are not kept. In the stats, items counts allocations, bytes
+    // the memory newly obtained from malloc, and push_wait the time spent
+    // blocked on the ceiling.
+    class BufferPool {
+    private:
+        static constexpr int min_shift = 12;
+        static constexpr int nclasses = 15;
+        mutex lock;
+        condition_variable released;
+        vector<char *> free_lists[nclasses];
+        size_t in_use = 0;
+        size_t cached = 0;
+        size_t max_bytes = size_t(-1);
+        size_t max_cached = size_t(64) << 20;
+        static int size_class(size_t size) {
+            int shift = min_shift;
+            while(shift < min_shift + nclasses && (size_t(1) << shift) < size) shift++;
+            return shift - min_shift;
+        }
+        static size_t capacity(int cls, size_t size) {
+            return cls < nclasses ? size_t(1) << (cls + min_shift) : size;
+        }
+        void trim() {
+            for(int i=nclasses-1; i>=0 && cached > max_cached; i--) {
+                while(!free_lists[i].empty() && cached > max_cached) {
+                    free(free_lists[i].back());
+                    free_lists[i].pop_back();
+                    cached -= size_t(1) << (i + min_shift);
+                }
+            }
+        }
+        void release(char *buffer, int cls, size_t capacity) {
+            {
+                lock_guard<mutex> guard(lock);
+                in_use -= capacity;
+                if(cls < nclasses && cached + capacity <= max_cached) {
+                    free_lists[cls].push_back(buffer);
+                    cached += capacity;
+                    buffer = nullptr;
+                }
+            }
+            released.notify_all();
+            free(buffer);
+        }
+    public:
+        void configure(size_t max_bytes, size_t max_cached) {
+            {
+                lock_guard<mutex> guard(lock);
+                this->max_bytes = max_bytes;
+                this->max_cached = max_cached;
+                trim();
+            }
+            released.notify_all();
+        }
+        // The bytes a buffer of the given size takes from the ceiling.
+        static size_t capacity(size_t size) {
+            return size > 0 ? capacity(size_class(size), size) : 0;
+        }
+        bool exhausted() {
+            lock_guard<mutex> guard(lock);
+            return in_use >= max_bytes;
+        }
+        // An uninitialized buffer of at least size bytes. Above the ceiling
+        // this waits for other buffers to be released, unless the caller's
+        // pinned buffers alone leave no room, in which case waiting could
+        // never succeed and the buffer is granted anyway.
+        shared_ptr<char> allocate(size_t size) {
+            int cls = size_class(size);
+            size_t capacity = BufferPool::capacity(cls, size);
+            char *buffer = nullptr;
+            {
+                unique_lock<mutex> guard(lock);
+                size_t held = min(pinned_bytes, in_use);
+                auto fits = [&] {
+                    return in_use + capacity <= max_bytes || held + capacity > max_bytes ||
+                           in_use == held;
+                };
+                if(!fits()) {
+                    auto start = chrono::steady_clock::now();
+                    released.wait(guard, fits);
+                    pool_stats.push_wait.add(nanoseconds_since(start));
+                }
+                in_use += capacity;
+                if(cls < nclasses && !free_lists[cls].empty()) {
+                    buffer = free_lists[cls].back();
+                    free_lists[cls].pop_back();
+                    cached -= capacity;
+                }
+            }
+            pool_stats.items.add(1);
+            if(!buffer) {
+                buffer = (char *)malloc(capacity);
+                if(!buffer) {
+                    release(nullptr, nclasses, capacity);
+                    throw bad_alloc();
+                }
+                pool_stats.bytes.add(capacity);
+            }
+            return shared_ptr<char>(buffer, [this, cls, capacity](char *buffer) {
+                release(buffer, cls, capacity);
+            });
         }
     };
 
-    IWebDatasetReader *make_WebDatasetReader() {
-        return new WebDatasetReader();
+    // Never destroyed, so that buffers may outlive static destruction.
+    BufferPool &buffer_pool() {
+        static BufferPool *pool = new BufferPool();
+        return *pool;
+    }
+
+    // The pool bytes taken by the payloads of a sample.
+    size_t pool_bytes(const SampleView &sample) {
+        size_t total = 0;
+        for(auto &[k, v] : sample)
+            if(k != "__key__") total += BufferPool::capacity(v.size());
+        return total;
+    }
+
+    // Pins pool bytes for the lifetime of the scope; see BufferPool::allocate.
+    struct Pin {
+        size_t bytes = 0;
+        Pin(size_t bytes = 0) { add(bytes); }
+        Pin(const Pin &) = delete;
+        ~Pin() { pinned_bytes -= bytes; }
+        void add(size_t n) {
+            bytes += n;
+            pinned_bytes += n;
+        }
+    };
+
+    void set_buffer_pool(size_t max_bytes, size_t max_cached) {
+        buffer_pool().configure(max_bytes, max_cached);
+    }
+
+    void set_memory_budget(size_t max_bytes) {
+        memory_budget().configure(max_bytes);
+    }
+
+    struct ShardFile {
+        int fd = -1;
+        ~ShardFile() {
+            if(fd >= 0) close(fd);
+        }
+    };
+
+    struct LazyBytes::State {
+        once_flag once;
+        Bytes bytes;
+        shared_ptr<ShardFile> file;
+        size_t offset = 0;
+    };
+
+    LazyBytes::LazyBytes(const Bytes &bytes) : state(make_shared<State>()), length(bytes.size()) {
+        state->bytes = bytes;
+    }
+
+    LazyBytes::LazyBytes(shared_ptr<ShardFile> file, size_t offset, size_t size)
+        : state(make_shared<State>()), length(size) {
+        state->file = file;
+        state->offset = offset;
+    }
+
+    const Bytes &LazyBytes::get() const {
+        static const Bytes empty;
+        if(!state) return empty;
+        call_once(state->once, [this] {
+            if(!state->file) return;
+            auto buffer = buffer_pool().allocate(length);
+            for(size_t done = 0; done < length; ) {
+                ssize_t n = pread(state->file->fd, buffer.get() + done, length - done, state->offset + done);
+                if(n <= 0) throw short_tar_read();
+                done += n;
+            }
+            state->bytes = Bytes(buffer, buffer.get(), length);
+            state->file = nullptr;
+            tar_stats.bytes.add(length);
+        });
+        return state->bytes;
+    }
+
+    shared_ptr<LazySample> to_lazy(shared_ptr<SampleView> sample) {
+        if(!sample) return nullptr;
+        auto result = make_shared<LazySample>();
+        for(auto &[k, v] : *sample)
+            (*result)[k] = LazyBytes(v);
+        return result;
+    }
+
+    // Reads member headers eagerly and payloads on demand: a payload that
+    // is never asked for is skipped by seeking (or offset arithmetic on a
+    // mapping) when the reader moves on.
+    class FileReader {
+    private:
+        Stdio stream;
+        Mmap mapping;
+        size_t offset = 0;
+        bool eof = false;
+        bool has_item = false;
+        bool loaded = false;
+        size_t pending = 0;
+        IndexEntry entry;
+        Bytes payload;
+        Overrides local;
+        Overrides global;
+        string extension;
+        string path;
+        shared_ptr<ShardFile> file;
+        size_t file_size = 0;
+        bool resync = false;
+        bool resyncing = false;
+        // Without a stream or mapping, file is read with pread.
+        bool positioned() const {
+            return !stream && !mapping;
+        }
+        void pread_all(char *dst, size_t size) {
+            if(offset + size > file_size) throw bad_tar_format();
+            for(size_t done = 0; done < size; ) {
+                ssize_t n = pread(file->fd, dst + done, size - done, offset + done);
+                if(n <= 0) throw bad_tar_format();
+                done += n;
+            }
+        }
+        const posix_header &read_header(posix_header &buffer) {
+            if(mapping) {
+                if(offset + sizeof buffer > mapping->size) throw bad_tar_format();
+                auto header = (const posix_header *)(mapping->data + offset);
+                offset += sizeof buffer;
+                return *header;
+            }
+            if(positioned()) {
+                pread_all((char *)&buffer, sizeof buffer);
+            } else if(fread((char *)&buffer, 1, sizeof buffer, stream.get()) != sizeof buffer) {
+                throw bad_tar_format();
+            }
+            offset += sizeof buffer;
+            return buffer;
+        }
+        void skip_payload(size_t amount) {
+            if(mapping) {
+                if(offset + amount > mapping->size) throw bad_tar_format();
+            } else if(positioned()) {
+                if(offset + amount > file_size) throw bad_tar_format();
+            } else if(amount < 65536 || fseeko(stream.get(), amount, SEEK_CUR) != 0) {
+                char scratch[4096];
+                for(size_t left = amount; left > 0; ) {
+                    size_t n = fread(scratch, 1, min(left, sizeof scratch), stream.get());
+                    if(n <= 0) throw bad_tar_format();
+                    left -= n;
+                }
+            }
+            offset += amount;
+        }
+        void read_data(char *dst, size_t size) {
+            if(mapping) {
+                if(offset + size > mapping->size) throw bad_tar_format();
+                memcpy(dst, mapping->data + offset, size);
+            } else if(positioned()) {
+                pread_all(dst, size);
+            } else if(fread(dst, 1, size, stream.get()) != size) {
+                throw bad_tar_format();
+            }
+            offset += size;
+        }
+        bool at_end() {
+            return eof || (stream && feof(stream.get()));
+        }
+        void reset() {
+            offset = 0;
+            eof = false;
+            has_item = false;
+            pending = 0;
+            local = Overrides();
+            global = Overrides();
+            resyncing = false;
+        }
+        // Reads the payload of an extended header into extension.
+        void read_extension(uint64_t size) {
+            if(size > (1 << 24)) throw bad_tar_format();
+            extension.resize(size);
+            read_data(&extension[0], size);
+            skip_payload((size + 511) / 512 * 512 - size);
+        }
+    public:
+        FileReader() = default;
+        void set_stream(Stdio stream) {
+            this->stream = stream;
+            mapping = nullptr;
+            path.clear();
+            file = nullptr;
+            reset();
+        }
+        // With resync, a corrupt header is skipped by scanning block by
+        // block for the next valid one instead of throwing.
+        void set_resync(bool flag) {
+            resync = flag;
+        }
+        size_t position() const {
+            return offset;
+        }
+        // Names the local file behind the stream, for lazy payloads.
+        void set_path(const string &path) {
+            this->path = path;
+            file = nullptr;
+        }
+        void set_mapping(Mmap mapping) {
+            this->mapping = mapping;
+            stream = nullptr;
+            reset();
+        }
+        // Reads a local file with positioned reads, so that skipping a
+        // payload costs nothing; the fastest way to scan headers only.
+        void set_file(const string &path) {
+            auto file = make_shared<ShardFile>();
+            file->fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if(file->fd < 0 || fstat(file->fd, &st) != 0) throw gopen_err();
+            stream = nullptr;
+            mapping = nullptr;
+            this->path = path;
+            this->file = file;
+            file_size = st.st_size;
+            reset();
+        }
+        // Position at the member header at the given byte offset. Streams
+        // that cannot seek are read forward instead.
+        void seek(size_t position) {
+            if(mapping) {
+                if(position > mapping->size) throw seek_err();
+            } else if(positioned()) {
+                if(position > file_size) throw seek_err();
+            } else if(fseeko(stream.get(), position, SEEK_SET) != 0) {
+                if(position < offset) throw seek_err();
+                skip_payload(position - offset);
+            }
+            reset();
+            offset = position;
+        }
+        bool fetch() {
+            has_item = false;
+            if(pending > 0) skip_payload(pending);
+            pending = 0;
+            size_t start = offset;
+            while(!at_end()) {
+                posix_header buffer;
+                const posix_header &header = read_header(buffer);
+                if(header.typeflag == '\0' && (!resyncing || is_zero_block(header))) {
+                    eof = true;
+                    break;
+                }
+                uint64_t size;
+                if(!valid_checksum(header) || !parse_number(header.size, sizeof header.size, size)) {
+                    if(!resync) throw bad_tar_format();
+                    if(!resyncing) error_stats.items.add(1);
+                    resyncing = true;
+                    local = Overrides();
+                    start = offset;
+                    continue;
+                }
+                resyncing = false;
+                if(header.typeflag != '0') {
+                    // Extended headers describe the member that follows, so
+                    // its entry still starts at the first of them.
+                    if(header.typeflag == 'x' || header.typeflag == 'g') {
+                        read_extension(size);
+                        parse_pax(extension, header.typeflag == 'x' ? local : global);
+                    } else if(header.typeflag == 'L') {
+                        read_extension(size);
+                        local.name.assign(extension.c_str());
+                        local.has_name = true;
+                    } else {
+                        if(local.has_size) size = local.size;
+                        skip_payload((size + 511) / 512 * 512);
+                        local = Overrides();
+                        start = offset;
+                    }
+                    continue;
+                }
+                entry.offset = start;
+                if(local.has_size || global.has_size)
+                    size = local.has_size ? local.size : global.size;
+                entry.size = size;
+                if(local.has_name || global.has_name) {
+                    entry.name = local.has_name ? local.name : global.name;
+                } else {
+                    size_t nprefix = strnlen(header.prefix, sizeof header.prefix);
+                    entry.name.assign(header.prefix, nprefix);
+                    if(nprefix > 0) entry.name += '/';
+                    entry.name.append(header.name, strnlen(header.name, sizeof header.name));
+                }
+                local = Overrides();
+                size_t rounded = (size + 511) / 512 * 512;
+                tar_stats.items.add(1);
+                pending = rounded;
+                loaded = false;
+                has_item = true;
+                return true;
+            }
+            return false;
+        }
+        // The current member, or nullptr at the end of the archive.
+        const IndexEntry *peek() {
+            if(!has_item && !fetch()) return nullptr;
+            return &entry;
+        }
+        void next() {
+            if(!has_item) fetch();
+            has_item = false;
+        }
+        // The payload of the current member; a view into the mapping, or
+        // a freshly read buffer for streams.
+        Bytes data() {
+            if(loaded) return payload;
+            size_t size = entry.size;
+            size_t padding = pending - size;
+            if(mapping) {
+                if(offset + pending > mapping->size) throw bad_tar_format();
+                payload = Bytes(mapping, mapping->data + offset, size);
+                offset += size;
+            } else if(size > 0) {
+                auto buffer = buffer_pool().allocate(size);
+                read_data(buffer.get(), size);
+                payload = Bytes(buffer, buffer.get(), size);
+            } else {
+                payload = Bytes();
+            }
+            skip_payload(padding);
+            pending = 0;
+            loaded = true;
+            tar_stats.bytes.add(size);
+            return payload;
+        }
+        // The payload of the current member, left unread if the shard is a
+        // local file so that next() seeks past it.
+        LazyBytes lazy_data() {
+            if(loaded || mapping || path.empty()) return LazyBytes(data());
+            if(!file) {
+                file = make_shared<ShardFile>();
+                file->fd = open(path.c_str(), O_RDONLY);
+                if(file->fd < 0) {
+                    file = nullptr;
+                    throw gopen_err();
+                }
+            }
+            return LazyBytes(file, offset, entry.size);
+        }
+        // Copies the payload of the current member into dst, which must
+        // hold peek()->size bytes.
+        void read_into(char *dst) {
+            if(loaded) {
+                memcpy(dst, payload.data(), payload.size());
+                return;
+            }
+            size_t size = entry.size;
+            size_t padding = pending - size;
+            read_data(dst, size);
+            skip_payload(padding);
+            pending = 0;
+            tar_stats.bytes.add(size);
+        }
+    };
+
+
+    class SampleReader {
+    private:
+        shared_ptr<FileReader> source;
+        shared_ptr<SampleView> item;
+        size_t item_offset = 0;
+        size_t arena_hint = 0;
+        set<string, less<>> fields;
+        bool wanted(string_view ext) {
+            return fields.empty() || fields.find(ext) != fields.end();
+        }
+        // Skips nameless members and returns the key of the next sample.
+        bool next_key(string &key) {
+            auto file = source->peek();
+            while(file && splitext(file->name).first.empty()) {
+                source->next();
+                file = source->peek();
+            }
+            if(!file) return false;
+            key = splitext(file->name).first;
+            return true;
+        }
+    public:
+        SampleReader() = default;
+        void set_fields(const set<string> &fields) {
+            this->fields = set<string, less<>>(fields.begin(), fields.end());
+        }
+        void set_source(shared_ptr<FileReader> source) {
+            this->source = source;
+            item = nullptr;
+        }
+        // True if another sample follows; only reads a member header.
+        bool more() {
+            return item || source->peek();
+        }
+        // The offset of the next sample; only valid if more().
+        size_t position() {
+            return item ? item_offset : source->peek()->offset;
+        }
+        bool fetch() {
+            item = nullptr;
+            string key = "";
+            Pin pin;
+            for(;;) {
+                auto file = source->peek();
+                if(!file) {
+                    if(item) sample_stats.items.add(1);
+                    return bool(item);
+                }
+                auto [base, ext] = splitext(file->name);
+                if(base.empty()) {
+                    source->next();
+                    continue;
+                }
+                if(key=="") {
+                    key = base;
+                    item_offset = file->offset;
+                    item = make_shared<SampleView>();
+                    (*item)["__key__"s] = Bytes(key);
+                }
+                if(key!=base) {
+                    sample_stats.items.add(1);
+                    return true;
+                }
+                if(wanted(ext)) {
+                    Bytes data = source->data();
+                    sample_stats.bytes.add(data.size());
+                    pin.add(BufferPool::capacity(data.size()));
+                    (*item)[string(ext)] = data;
+                }
+                source->next();
+            }
+        }
+        shared_ptr<SampleView> next() {
+            if(!item) fetch();
+            shared_ptr<SampleView> result = item;
+            item = nullptr;
+            return result;
+        }
+        shared_ptr<SampleView> peek() {
+            if(!item) fetch();
+            return item;
+        }
+        // Reads the next sample straight into a CompactSample arena.
+        shared_ptr<CompactSample> next_compact() {
+            if(item) return to_compact(next());
+            string key;
+            if(!next_key(key)) return nullptr;
+            auto result = make_shared<CompactSample>();
+            result->reserve(max(arena_hint, key.size()));
+            result->set_key(key);
+            while(auto file = source->peek()) {
+                auto [base, ext] = splitext(file->name);
+                if(base != key) break;
+                if(wanted(ext)) source->read_into(result->append(ext, file->size));
+                source->next();
+            }
+            arena_hint = result->bytes();
+            sample_stats.items.add(1);
+            sample_stats.bytes.add(result->bytes());
+            return result;
+        }
+        shared_ptr<LazySample> next_lazy() {
+            if(item) return to_lazy(next());
+            string key;
+            if(!next_key(key)) return nullptr;
+            auto result = make_shared<LazySample>();
+            (*result)["__key__"] = LazyBytes(Bytes(key));
+            while(auto file = source->peek()) {
+                auto [base, ext] = splitext(file->name);
+                if(base != key) break;
+                if(wanted(ext)) {
+                    sample_stats.bytes.add(file->size);
+                    (*result)[string(ext)] = source->lazy_data();
+                }
+                source->next();
+            }
+            sample_stats.items.add(1);
+            return result;
+        }
+    };
+
+
+    string index_name(const string &url) {
+        return url + ".idx";
+    }
+
+    ShardIndex scan_index(const string &url) {
+        FileReader files;
+        if(url.find("pipe:") == 0 || is_compressed(url)) {
+            files.set_stream(gopen(url));
+        } else {
+            files.set_file(url);
+        }
+        ShardIndex index;
+        while(auto entry = files.peek()) {
+            index.push_back(*entry);
+            files.next();
+        }
+        return index;
+    }
+
+    void save_index(const string &url, const ShardIndex &index) {
+        string fname = index_name(url);
+        string tmp = fname + ".tmp";
+        FILE *stream = fopen(tmp.c_str(), "w");
+        if(!stream) throw gopen_err();
+        for(auto &entry : index) {
+            fprintf(stream, "%zu %zu %s\n", entry.offset, entry.size, entry.name.c_str());
+        }
+        bool ok = fclose(stream) == 0;
+        if(!ok || rename(tmp.c_str(), fname.c_str()) != 0) {
+            unlink(tmp.c_str());
+            throw gopen_err();
+        }
+    }
+
+    bool read_index(const string &url, ShardIndex &index) {
+        string fname = index_name(url);
+        struct stat shard, sidecar;
+        if(stat(fname.c_str(), &sidecar) != 0) return false;
+        if(stat(url.c_str(), &shard) == 0 && shard.st_mtime > sidecar.st_mtime) return false;
+        ifstream stream(fname);
+        IndexEntry entry;
+        while(stream >> entry.offset >> entry.size) {
+            stream.get();
+            if(!getline(stream, entry.name)) return false;
+            index.push_back(entry);
+        }
+        return stream.eof();
+    }
+
+    ShardIndex load_index(const string &url) {
+        ShardIndex index;
+        if(url.find("pipe:") != 0 && read_index(url, index)) return index;
+        index = scan_index(url);
+        if(url.find("pipe:") != 0) {
+            try {
+                save_index(url, index);
+            } catch(gopen_err &) {
+            }
+        }
+        return index;
+    }
+
+    string cache_dir;
+    size_t cache_max_bytes = 0;
+    mutex cache_lock;
+    Stage &cache_hits = stage("cache.hit");
+    Stage &cache_misses = stage("cache.miss");
+
+    void set_cache(const string &dir, size_t max_bytes) {
+        if(!dir.empty() && mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) throw gopen_err();
+        cache_dir = dir;
+        cache_max_bytes = max_bytes;
+    }
+
+    // Cache files are named by the FNV-1a hash of the URL.
+    string cache_name(const string &url) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for(unsigned char c : url) {
+            hash ^= c;
+            hash *= 0x100000001b3ull;
+        }
+        char name[32];
+        snprintf(name, sizeof name, "/%016llx.tar", (unsigned long long)hash);
+        return cache_dir + name;
+    }
+
+    // Deletes the oldest cached shards until the rest fit in the budget.
+    // Hits refresh a file's mtime, so this is LRU order. Open or mapped
+    // shards stay readable after they are unlinked.
+    void evict_cache() {
+        lock_guard<mutex> guard(cache_lock);
+        DIR *dir = opendir(cache_dir.c_str());
+        if(!dir) return;
+        vector<tuple<timespec, size_t, string>> files;
+        size_t total = 0;
+        while(dirent *item = readdir(dir)) {
+            string fname = cache_dir + "/" + item->d_name;
+            struct stat st;
+            if(!ends_with(fname, ".tar") || stat(fname.c_str(), &st) != 0) continue;
+            files.emplace_back(st.st_mtim, st.st_size, fname);
+            total += st.st_size;
+        }
+        closedir(dir);
+        sort(files.begin(), files.end(), [](auto &a, auto &b) {
+            auto &x = get<0>(a), &y = get<0>(b);
+            return x.tv_sec != y.tv_sec ? x.tv_sec < y.tv_sec : x.tv_nsec < y.tv_nsec;
+        });
+        for(auto &[mtime, size, fname] : files) {
+            if(total <= cache_max_bytes) break;
+            if(unlink(fname.c_str()) == 0) total -= size;
+        }
+    }
+
+    // Copies everything read from a pipe into a temporary file, which is
+    // renamed into the cache once the command has exited successfully.
+    // Closing early reads the rest of the pipe so that the copy is whole.
+    struct TeeCookie {
+        FILE *source = nullptr;
+        FILE *copy = nullptr;
+        string tmp;
+        string fname;
+        size_t bytes = 0;
+        bool failed = false;
+        void write(const char *buf, size_t n) {
+            if(!failed && fwrite(buf, 1, n, copy) != n) failed = true;
+            bytes += n;
+        }
+    };
+
+    ssize_t tee_read(void *cookie, char *buf, size_t size) {
+        auto tee = (TeeCookie *)cookie;
+        size_t n = fread(buf, 1, size, tee->source);
+        if(n == 0 && ferror(tee->source)) {
+            tee->failed = true;
+            return -1;
+        }
+        tee->write(buf, n);
+        return n;
+    }
+
+    int tee_close(void *cookie) {
+        unique_ptr<TeeCookie> tee((TeeCookie *)cookie);
+        char buf[65536];
+        while(!tee->failed) {
+            size_t n = fread(buf, 1, sizeof buf, tee->source);
+            if(n == 0) break;
+            tee->write(buf, n);
+        }
+        if(ferror(tee->source)) tee->failed = true;
+        int status = pclose(tee->source);
+        if(fclose(tee->copy) != 0 || status != 0) tee->failed = true;
+        if(tee->failed || rename(tee->tmp.c_str(), tee->fname.c_str()) != 0) {
+            unlink(tee->tmp.c_str());
+            return status == 0 ? 0 : -1;
+        }
+        cache_misses.bytes.add(tee->bytes);
+        evict_cache();
+        return 0;
+    }
+
+    Stdio tee_open(const string &url, const string &fname) {
+        static atomic<int> counter{0};
+        auto tee = make_unique<TeeCookie>();
+        tee->fname = fname;
+        tee->tmp = fname + "." + to_string(getpid()) + "." + to_string(counter++) + ".tmp";
+        tee->copy = fopen(tee->tmp.c_str(), "wb");
+        if(!tee->copy) return gopen(url);
+        tee->source = popen(url.substr(5).c_str(), "r");
+        if(!tee->source) {
+            fclose(tee->copy);
+            unlink(tee->tmp.c_str());
+            throw gopen_err();
+        }
+        cookie_io_functions_t io{tee_read, nullptr, nullptr, tee_close};
+        FILE *stream = fopencookie(tee.get(), "r", io);
+        if(!stream) {
+            pclose(tee->source);
+            fclose(tee->copy);
+            unlink(tee->tmp.c_str());
+            throw gopen_err();
+        }
+        tee.release();
+        return Stdio(stream, fclose);
+    }
+
+    // Opens a cached copy of a pipe: shard, or starts caching it.
+    void open_cached(FileReader &files, const string &url, bool use_mmap) {
+        string fname = cache_name(url);
+        if(utimensat(AT_FDCWD, fname.c_str(), nullptr, 0) == 0) {
+            try {
+                if(use_mmap) {
+                    files.set_mapping(mopen(fname));
+                } else {
+                    files.set_stream(gopen(fname));
+                }
+                cache_hits.items.add(1);
+                return;
+            } catch(gopen_err &) {
+                // evicted in the meantime
+            }
+        }
+        files.set_stream(tee_open(url, fname));
+        cache_misses.items.add(1);
+    }
+
+    shared_ptr<FileReader> open_shard(const string &url, bool use_mmap) {
+        auto start = chrono::steady_clock::now();
+        auto files = make_shared<FileReader>();
+        if(!cache_dir.empty() && url.find("pipe:") == 0) {
+            open_cached(*files, url, use_mmap);
+        } else if(use_mmap && url.find("pipe:") != 0 && !is_compressed(url)) {
+            files->set_mapping(mopen(url));
+        } else {
+            files->set_stream(gopen(url));
+            if(url.find("pipe:") != 0 && !is_compressed(url)) files->set_path(url);
+        }
+        open_stats.items.add(1);
+        open_stats.latency.record(nanoseconds_since(start));
+        return files;
+    }
+
+    // Retries a failing open as the policy allows, then resyncs past
+    // corrupt headers if it asks to skip members.
+    shared_ptr<FileReader> open_shard(const string &url, bool use_mmap, const ErrorPolicy &policy) {
+        for(int attempt=0; ; attempt++) {
+            try {
+                auto files = open_shard(url, use_mmap);
+                files->set_resync(policy.action == ErrorPolicy::skip_member);
+                return files;
+            } catch(webdataset_error &error) {
+                if(attempt >= policy.open_retries) throw;
+                error_stats.items.add(1);
+                nsleep(policy.backoff * (1 << min(attempt, 20)));
+            }
+        }
+    }
+
+    class TarReader : public ITarReader {
+    private:
+        shared_ptr<FileReader> files;
+    public:
+        TarReader(const string &url, bool use_mmap) : files(open_shard(url, use_mmap)) {}
+        const IndexEntry *peek() {
+            return files->peek();
+        }
+        Bytes data() {
+            return files->data();
+        }
+        void next() {
+            files->next();
+        }
+    };
+
+    ITarReader *make_TarReader(const string &url, bool use_mmap) {
+        return new TarReader(url, use_mmap);
+    }
+
+    shared_ptr<Sample> to_sample(shared_ptr<SampleView> view) {
+        if(!view) return nullptr;
+        auto sample = make_shared<Sample>();
+        for(auto &[k, v] : *view) {
+            sample->emplace_hint(sample->end(), k, v.str());
+        }
+        return sample;
+    }
+
+
+    // Returns the position of the brace closing the one at start, or npos.
+    size_t closing_brace(const string &s, size_t start) {
+        int depth = 0;
+        for(size_t i=start; i<s.size(); i++) {
+            if(s[i] == '{') depth++;
+            if(s[i] == '}' && --depth == 0) return i;
+        }
+        return string::npos;
+    }
+
+    vector<string> expand_alternative(const string &body) {
+        size_t dots = body.find("..");
+        if(dots != string::npos && dots > 0 && dots + 2 < body.size() &&
+           body.find_first_not_of("0123456789.") == string::npos) {
+            string first = body.substr(0, dots), last = body.substr(dots + 2);
+            if(last.find('.') != string::npos) throw split_err();
+            long lo = stol(first), hi = stol(last);
+            long step = lo <= hi ? 1 : -1;
+            vector<string> result;
+            for(long i=lo; ; i+=step) {
+                char buffer[32];
+                snprintf(buffer, sizeof buffer, "%0*ld", int(first.size()), i);
+                result.push_back(buffer);
+                if(i == hi) break;
+            }
+            return result;
+        }
+        vector<string> result;
+        int depth = 0;
+        size_t start = 0;
+        for(size_t i=0; i<=body.size(); i++) {
+            if(i == body.size() || (body[i] == ',' && depth == 0)) {
+                result.push_back(body.substr(start, i - start));
+                start = i + 1;
+            } else if(body[i] == '{') {
+                depth++;
+            } else if(body[i] == '}') {
+                depth--;
+            }
+        }
+        return result;
+    }
+
+    vector<string> expand_urls(const string &spec) {
+        size_t open = spec.find('{');
+        if(open == string::npos) return {spec};
+        size_t close = closing_brace(spec, open);
+        if(close == string::npos) throw split_err();
+        string prefix = spec.substr(0, open);
+        string rest = spec.substr(close + 1);
+        vector<string> result;
+        for(auto &alternative : expand_alternative(spec.substr(open + 1, close - open - 1))) {
+            for(auto &url : expand_urls(alternative + rest))
+                result.push_back(prefix + url);
+        }
+        return result;
+    }
+
+    // The permutation is computed by hand rather than with std::shuffle so
+    // that it is the same with every standard library.
+    vector<string> split_shards(const vector<string> &urls, const ShardSplit &split, uint64_t epoch) {
+        if(split.world_size < 1 || split.num_workers < 1 ||
+           split.rank < 0 || split.rank >= split.world_size ||
+           split.worker_id < 0 || split.worker_id >= split.num_workers)
+            throw split_err();
+        vector<size_t> order(urls.size());
+        for(size_t i=0; i<order.size(); i++) order[i] = i;
+        if(split.shuffle) {
+            mt19937_64 rng(split.seed * 0x9e3779b97f4a7c15ull + epoch);
+            for(size_t i=order.size(); i>1; i--)
+                swap(order[i - 1], order[rng() % i]);
+        }
+        // Consecutive shards go to different ranks first, so that leftover
+        // shards are spread over ranks before workers.
+        size_t nslots = size_t(split.world_size) * split.num_workers;
+        size_t slot = size_t(split.worker_id) * split.world_size + split.rank;
+        size_t total = order.size();
+        if(split.even && total > 0) total = (total + nslots - 1) / nslots * nslots;
+        vector<string> result;
+        for(size_t i=slot; i<total; i+=nslots)
+            result.push_back(urls[order[i % order.size()]]);
+        return result;
+    }
+
+    function<void(vector<string> &)> shard_refill(const vector<string> &urls, const ShardSplit &split,
+                                                  uint64_t first_epoch) {
+        auto epoch = make_shared<atomic<uint64_t>>(first_epoch);
+        return [urls, split, epoch](vector<string> &result) {
+            result = split_shards(urls, split, (*epoch)++);
+        };
+    }
+
+    string save_state(const ReaderState &state) {
+        ostringstream stream;
+        stream << "epoch " << state.epoch << "\n";
+        if(!state.rng.empty()) stream << "rng " << state.rng << "\n";
+        if(!state.current_url.empty()) {
+            stream << "current " << state.current_url << "\n";
+            stream << "offset " << state.offset << "\n";
+        }
+        for(auto &url : state.urls)
+            stream << "url " << url << "\n";
+        for(auto &[url, offset] : state.buffered)
+            stream << "buffered " << offset << " " << url << "\n";
+        return stream.str();
+    }
+
+    static uint64_t parse_state_number(const string &value) {
+        char *end = nullptr;
+        errno = 0;
+        unsigned long long number = strtoull(value.c_str(), &end, 10);
+        if(value.empty() || *end || errno) throw state_err();
+        return number;
+    }
+
+    ReaderState load_state(const string &text) {
+        ReaderState state;
+        istringstream stream(text);
+        string line;
+        while(getline(stream, line)) {
+            size_t space = line.find(' ');
+            if(space == string::npos) throw state_err();
+            string name = line.substr(0, space);
+            string value = line.substr(space + 1);
+            if(name == "url") {
+                state.urls.push_back(value);
+            } else if(name == "current") {
+                state.current_url = value;
+            } else if(name == "rng") {
+                state.rng = value;
+            } else if(name == "epoch") {
+                state.epoch = parse_state_number(value);
+            } else if(name == "offset") {
+                state.offset = parse_state_number(value);
+            } else if(name == "buffered") {
+                size_t split = value.find(' ');
+                if(split == string::npos) throw state_err();
+                state.buffered.emplace_back(value.substr(split + 1),
+                                            parse_state_number(value.substr(0, split)));
+            } else {
+                throw state_err();
+            }
+        }
+        return state;
+    }
+
+    class WebDatasetReader : public IWebDatasetReader {
+    private:
+        vector<string> urls;
+        string current_url;
+        shared_ptr<FileReader> files;
+        shared_ptr<SampleReader> samples;
+        function<void(vector<string> &)> refill = [](vector<string> &){};
+        uint64_t epoch = 0;
+        bool use_mmap = false;
+        set<string> fields;
+        ErrorPolicy policy;
+        bool indexed = false;
+        vector<size_t> sample_offsets;
+        map<string, size_t> sample_keys;
+        void open_index() {
+            if(indexed) return;
+            if(current_url.find("pipe:") == 0 || is_compressed(current_url)) throw seek_err();
+            ShardIndex index = load_index(current_url);
+            string key = "";
+            for(auto &entry : index) {
+                auto [base, ext] = splitext(entry.name);
+                if(base.empty() || base == key) continue;
+                key = base;
+                sample_keys[key] = sample_offsets.size();
+                sample_offsets.push_back(entry.offset);
+            }
+            indexed = true;
+        }
+        // Adds the shard and offset to an error being handled, then either
+        // rethrows it or drops the shard so that reading goes on with the
+        // next one.
+        void recover(webdataset_error &error) {
+            error.set_context(current_url, files ? files->position() : size_t(-1));
+            error_stats.items.add(1);
+            if(policy.action == ErrorPolicy::fail) throw;
+            files = nullptr;
+            samples = nullptr;
+        }
+        // Within one shard, reading stops where that shard ends or is
+        // dropped.
+        template <class T>
+        shared_ptr<T> read(shared_ptr<T> (SampleReader::*method)(), bool within_shard=false) {
+            for(;;) {
+                try {
+                    if(within_shard ? !samples : !forward()) return nullptr;
+                    return (samples.get()->*method)();
+                } catch(webdataset_error &error) {
+                    recover(error);
+                }
+            }
+        }
+    public:
+        WebDatasetReader() = default;
+        void add_url(const string &url) {
+            urls.push_back(url);
+        }
+        void set_urls(const vector<string> &urls) {
+            this->urls = urls;
+            files = nullptr;
+            samples = nullptr;
+        }
+        void set_refill(function<void(vector<string> &)> refill) {
+            this->refill = refill;
+        }
+        // The refill reads the split for the epoch after the current one.
+        void set_shards(const vector<string> &urls, const ShardSplit &split, uint64_t epoch) {
+            set_urls(split_shards(urls, split, epoch));
+            this->epoch = epoch;
+            refill = [this, urls, split](vector<string> &result) {
+                result = split_shards(urls, split, this->epoch + 1);
+            };
+        }
+        void set_mmap(bool flag) {
+            use_mmap = flag;
+        }
+        bool next_url() {
+            if(urls.size() == 0) {
+                refill(urls);
+                if(urls.size() > 0) epoch++;
+            }
+            if(urls.size() == 0) 
+                return false;
+            current_url = urls.front();
+            urls.erase(urls.begin());
+            indexed = false;
+            sample_offsets.clear();
+            sample_keys.clear();
+            files = nullptr;
+            samples = nullptr;
+            files = open_shard(current_url, use_mmap, policy);
+            samples.reset(new SampleReader());
+            samples->set_fields(fields);
+            samples->set_source(files);
+            return true;
+        }
+        bool forward() {
+            while(!samples || !samples->more()) {
+                if(!next_url())
+                    return  false;
+            }
+            return true;
+        }
+        shared_ptr<SampleView> peek_view() {
+            return read(&SampleReader::peek);
+        }
+        shared_ptr<SampleView> next_view() {
+            return read(&SampleReader::next);
+        }
+        shared_ptr<CompactSample> next_compact() {
+            return read(&SampleReader::next_compact);
+        }
+        void set_error_policy(const ErrorPolicy &policy) {
+            this->policy = policy;
+        }
+        void set_fields(const set<string> &fields) {
+            this->fields = fields;
+            if(samples) samples->set_fields(fields);
+        }
+        shared_ptr<LazySample> next_lazy() {
+            return read(&SampleReader::next_lazy);
+        }
+        ReaderState get_state() {
+            ReaderState state;
+            state.urls = urls;
+            state.epoch = epoch;
+            if(samples && samples->more()) {
+                state.current_url = current_url;
+                state.offset = samples->position();
+            }
+            return state;
+        }
+        void set_state(const ReaderState &state) {
+            urls = state.urls;
+            epoch = state.epoch;
+            files = nullptr;
+            samples = nullptr;
+            if(state.current_url.empty()) return;
+            urls.insert(urls.begin(), state.current_url);
+            try {
+                next_url();
+                files->seek(state.offset);
+                samples->set_source(files);
+            } catch(webdataset_error &error) {
+                recover(error);
+            }
+        }
+        bool get_position(string &url, size_t &offset) {
+            if(!peek_view()) return false;
+            url = current_url;
+            offset = samples->position();
+            return true;
+        }
+        // Seeking is relative to the current shard; the first shard is
+        // opened if none is open yet.
+        bool seek_sample(size_t index) {
+            if(!files && !next_url()) return false;
+            open_index();
+            if(index >= sample_offsets.size()) return false;
+            files->seek(sample_offsets[index]);
+            samples->set_source(files);
+            return true;
+        }
+        bool seek_key(const string &key) {
+            if(!files && !next_url()) return false;
+            open_index();
+            auto it = sample_keys.find(key);
+            if(it == sample_keys.end()) return false;
+            return seek_sample(it->second);
+        }
+        vector<shared_ptr<Sample>> read_samples(size_t start, size_t end) {
+            vector<shared_ptr<Sample>> result;
+            if(start >= end || !seek_sample(start)) return result;
+            for(size_t i = start; i < end; i++) {
+                auto sample = to_sample(read(&SampleReader::next, true));
+                if(!sample) break;
+                result.push_back(sample);
+            }
+            return result;
+        }
+        shared_ptr<Sample> peek() {
+            return to_sample(peek_view());
+        }
+        shared_ptr<Sample> next() {
+            return to_sample(next_view());
+        }
+    };
+
+    IWebDatasetReader *make_WebDatasetReader() {
+        return new WebDatasetReader();
+    }
+
+
+    size_t sample_bytes(const SampleView &sample) {
+        size_t total = 0;
+        for(auto &[k, v] : sample)
+            total += v.size();
+        return total;
+    }
+
+    size_t view_bytes(const shared_ptr<SampleView> &sample) {
+        return sample ? sample_bytes(*sample) : 0;
+    }
+
+
+    // Keeps several shards open at once, each read by its own worker
+    // thread into a bounded queue; next() interleaves across the queues
+    // and skips shards that have nothing ready. Queued samples count
+    // against the memory budget.
+    class ParallelWebDatasetReader : public IWebDatasetReader {
+    private:
+        struct Slot {
+            Channel<shared_ptr<SampleView>> queue{32, view_bytes};
+            atomic<bool> done{false};
+            exception_ptr error;
+        };
+        int nshards;
+        bool randomize;
+        mt19937 rng;
+        size_t cursor = 0;
+        EventCount ready;
+        mutex lock;
+        vector<string> urls;
+        function<void(vector<string> &)> refill = [](vector<string> &){};
+        bool use_mmap = false;
+        set<string> fields;
+        ErrorPolicy policy;
+        atomic<bool> running{false};
+        vector<unique_ptr<Slot>> slots;
+        vector<thread> workers;
+        shared_ptr<SampleView> item;
+        bool take_url(string &url) {
+            lock_guard<mutex> guard(lock);
+            if(urls.size() == 0)
+                refill(urls);
+            if(urls.size() == 0)
+                return false;
+            url = urls.front();
+            urls.erase(urls.begin());
+            return true;
+        }
+        void work(Slot *slot) {
+            try {
+                string url;
+                while(running && take_url(url)) {
+                    SampleReader samples;
+                    ErrorPolicy policy;
+                    {
+                        lock_guard<mutex> guard(lock);
+                        samples.set_fields(fields);
+                        policy = this->policy;
+                    }
+                    shared_ptr<FileReader> files;
+                    try {
+                        files = open_shard(url, use_mmap, policy);
+                        samples.set_source(files);
+                        while(running) {
+                            auto sample = samples.next();
+                            if(!sample) break;
+                            if(!slot->queue.push(sample)) break;
+                            ready.notify();
+                        }
+                    } catch(webdataset_error &error) {
+                        error.set_context(url, files ? files->position() : size_t(-1));
+                        error_stats.items.add(1);
+                        if(policy.action == ErrorPolicy::fail) throw;
+                    }
+                }
+            } catch(...) {
+                slot->error = current_exception();
+            }
+            slot->done = true;
+            ready.notify();
+        }
+        void start() {
+            if(running) return;
+            running = true;
+            for(int i=0; i<nshards; i++) {
+                slots.emplace_back(new Slot());
+                slots.back()->queue.set_stats(&stage("parallel"));
+                workers.push_back(thread(&ParallelWebDatasetReader::work, this, slots.back().get()));
+            }
+        }
+        // Restarts a finished worker if urls were added after it ran out.
+        bool revive(size_t i) {
+            {
+                lock_guard<mutex> guard(lock);
+                if(urls.size() == 0) return false;
+            }
+            workers[i].join();
+            slots[i]->done = false;
+            workers[i] = thread(&ParallelWebDatasetReader::work, this, slots[i].get());
+            return true;
+        }
+        void stop() {
+            running = false;
+            for(auto &slot : slots)
+                slot->queue.close();
+            for(auto &worker : workers)
+                worker.join();
+            workers.clear();
+            slots.clear();
+            item = nullptr;
+        }
+    public:
+        ParallelWebDatasetReader(int nshards, bool randomize, unsigned seed)
+            : nshards(max(nshards, 1)), randomize(randomize), rng(seed) {}
+        ~ParallelWebDatasetReader() {
+            stop();
+        }
+        void add_url(const string &url) {
+            lock_guard<mutex> guard(lock);
+            urls.push_back(url);
+        }
+        void set_urls(const vector<string> &urls) {
+            stop();
+            this->urls = urls;
+        }
+        // The refill function is called from worker threads, serialized.
+        void set_refill(function<void(vector<string> &)> refill) {
+            lock_guard<mutex> guard(lock);
+            this->refill = refill;
+        }
+        void set_shards(const vector<string> &urls, const ShardSplit &split, uint64_t epoch) {
+            set_urls(split_shards(urls, split, epoch));
+            set_refill(shard_refill(urls, split, epoch + 1));
+        }
+        void set_mmap(bool flag) {
+            use_mmap = flag;
+        }
+        // Applies to shards opened from now on.
+        void set_fields(const set<string> &fields) {
+            lock_guard<mutex> guard(lock);
+            this->fields = fields;
+        }
+        void set_error_policy(const ErrorPolicy &policy) {
+            lock_guard<mutex> guard(lock);
+            this->policy = policy;
+        }
+        shared_ptr<SampleView> peek_view() {
+            if(item) return item;
+            start();
+            size_t n = slots.size();
+            for(bool waiting = false;; waiting = true) {
+                uint64_t key = waiting ? ready.prepare() : 0;
+                bool finished = true;
+                size_t first = randomize ? rng() % n : cursor;
+                for(size_t i=0; i<n; i++) {
+                    size_t index = (first + i) % n;
+                    Slot &slot = *slots[index];
+                    bool done = slot.done;
+                    if(slot.queue.try_pop(item)) {
+                        if(waiting) ready.cancel();
+                        cursor = (index + 1) % n;
+                        return item;
+                    }
+                    if(done && slot.error) {
+                        if(waiting) ready.cancel();
+                        exception_ptr error = slot.error;
+                        slot.error = nullptr;
+                        rethrow_exception(error);
+                    }
+                    if(done && revive(index)) done = false;
+                    if(!done) finished = false;
+                }
+                if(finished) {
+                    if(waiting) ready.cancel();
+                    return nullptr;
+                }
+                if(waiting) ready.wait(key);
+            }
+        }
+        shared_ptr<SampleView> next_view() {
+            shared_ptr<SampleView> result = peek_view();
+            item = nullptr;
+            return result;
+        }
+        shared_ptr<CompactSample> next_compact() {
+            return to_compact(next_view());
+        }
+        shared_ptr<LazySample> next_lazy() {
+            return to_lazy(next_view());
+        }
+        shared_ptr<Sample> peek() {
+            return to_sample(peek_view());
+        }
+        shared_ptr<Sample> next() {
+            return to_sample(next_view());
+        }
+        bool seek_sample(size_t) {
+            throw seek_err();
+        }
+        bool seek_key(const string &) {
+            throw seek_err();
+        }
+        vector<shared_ptr<Sample>> read_samples(size_t, size_t) {
+            throw seek_err();
+        }
+        ReaderState get_state() {
+            throw state_err("reader state not supported");
+        }
+        void set_state(const ReaderState &) {
+            throw state_err("reader state not supported");
+        }
+        bool get_position(string &, size_t &) {
+            return false;
+        }
+    };
+
+    IWebDatasetReader *make_ParallelWebDatasetReader(int nshards, bool randomize, unsigned seed) {
+        return new ParallelWebDatasetReader(nshards, randomize, seed);
+    }
+
+
+    // Sizes every column first so that each payload is copied exactly once.
+    template <class S>
+    shared_ptr<Batch> collate_samples(const vector<shared_ptr<S>> &samples) {
+        auto batch = make_shared<Batch>();
+        map<string, size_t> totals;
+        for(auto &sample : samples) {
+            for(auto &[k, v] : *sample)
+                if(k != "__key__") totals[k] += v.size();
+        }
+        for(auto &[k, total] : totals) {
+            auto &column = batch->columns[k];
+            column.data.reserve(total);
+            column.offsets.reserve(samples.size() + 1);
+        }
+        for(auto &sample : samples) {
+            auto key = sample->find("__key__");
+            batch->keys.push_back(key == sample->end() ? "" : string(key->second.data(), key->second.size()));
+            for(auto &[k, column] : batch->columns) {
+                auto field = sample->find(k);
+                if(field != sample->end())
+                    column.data.append(field->second.data(), field->second.size());
+                column.offsets.push_back(column.data.size());
+            }
+        }
+        return batch;
+    }
+
+    shared_ptr<Batch> collate(const vector<shared_ptr<Sample>> &samples) {
+        return collate_samples(samples);
+    }
+
+    shared_ptr<Batch> collate(const vector<shared_ptr<SampleView>> &samples) {
+        return collate_samples(samples);
+    }
+
+    shared_ptr<Batch> next_batch(IWebDatasetReader &reader, size_t max_samples, size_t max_bytes) {
+        vector<shared_ptr<SampleView>> samples;
+        size_t bytes = 0;
+        Pin pin;
+        while(samples.size() < max_samples && bytes < max_bytes) {
+            auto sample = reader.next_view();
+            if(!sample) break;
+            bytes += sample_bytes(*sample);
+            pin.add(pool_bytes(*sample));
+            samples.push_back(sample);
+        }
+        if(samples.size() == 0) return nullptr;
+        return collate(samples);
+    }
+
+    // Samples are drawn uniformly from the buffer and replaced by the swap
+    // with the last slot, so only shared_ptr handles ever move.
+    class ShuffleReader : public IWebDatasetReader {
+    private:
+        shared_ptr<IWebDatasetReader> source;
+        size_t capacity;
+        size_t initial;
+        size_t max_bytes;
+        mt19937 rng;
+        vector<shared_ptr<SampleView>> buffer;
+        // Where each buffered sample came from; an empty url if unknown.
+        vector<pair<string, size_t>> positions;
+        pair<string, size_t> item_position;
+        size_t bytes = 0;
+        size_t pooled = 0;
+        bool started = false;
+        shared_ptr<SampleView> item;
+        // Under memory pressure, or with the buffer pool at its ceiling, the
+        // buffer stops growing, down to one sample.
+        void fill() {
+            size_t target = started ? capacity : max(initial, size_t(1));
+            Pin pin(pooled);
+            while(buffer.size() < target &&
+                  (buffer.size() == 0 || (bytes < max_bytes && !memory_budget().exhausted() &&
+                                          !buffer_pool().exhausted()))) {
+                pair<string, size_t> position;
+                if(!source->get_position(position.first, position.second))
+                    position.first.clear();
+                auto sample = source->next_view();
+                if(!sample) break;
+                pin.add(push(sample, position));
+            }
+            started = true;
+        }
+        // Returns the pool bytes of the sample.
+        size_t push(shared_ptr<SampleView> sample, const pair<string, size_t> &position) {
+            size_t n = sample_bytes(*sample);
+            memory_budget().charge(n);
+            bytes += n;
+            size_t m = pool_bytes(*sample);
+            pooled += m;
+            buffer.push_back(sample);
+            positions.push_back(position);
+            return m;
+        }
+        void clear() {
+            buffer.clear();
+            positions.clear();
+            memory_budget().release(bytes);
+            bytes = 0;
+            pooled = 0;
+            started = false;
+            item = nullptr;
+        }
+    public:
+        ShuffleReader(shared_ptr<IWebDatasetReader> source, size_t capacity,
+                      size_t initial, size_t max_bytes, unsigned seed)
+            : source(source), capacity(max(capacity, size_t(1))),
+              initial(min(initial, this->capacity)), max_bytes(max_bytes), rng(seed) {}
+        ~ShuffleReader() {
+            memory_budget().release(bytes);
+        }
+        void add_url(const string &url) {
+            source->add_url(url);
+        }
+        void set_urls(const vector<string> &urls) {
+            clear();
+            source->set_urls(urls);
+        }
+        void set_refill(function<void(vector<string> &)> refill) {
+            source->set_refill(refill);
+        }
+        void set_mmap(bool flag) {
+            source->set_mmap(flag);
+        }
+        void set_fields(const set<string> &fields) {
+            source->set_fields(fields);
+        }
+        void set_error_policy(const ErrorPolicy &policy) {
+            source->set_error_policy(policy);
+        }
+        void set_shards(const vector<string> &urls, const ShardSplit &split, uint64_t epoch) {
+            clear();
+            source->set_shards(urls, split, epoch);
+        }
+        // A sample that was peeked but not consumed goes back to the buffer.
+        ReaderState get_state() {
+            ReaderState state = source->get_state();
+            ostringstream stream;
+            stream << rng;
+            state.rng = stream.str();
+            state.buffered = positions;
+            if(item) state.buffered.push_back(item_position);
+            for(auto &position : state.buffered)
+                if(position.first.empty()) throw state_err("buffered sample has no position");
+            return state;
+        }
+        // Replaces the buffer by the samples read back from their recorded
+        // positions; a state without a generator keeps the current one.
+        void set_state(const ReaderState &state) {
+            clear();
+            if(!state.rng.empty()) {
+                istringstream stream(state.rng);
+                if(!(stream >> rng)) throw state_err();
+            }
+            Pin pin;
+            for(auto &position : state.buffered) {
+                ReaderState at;
+                at.epoch = state.epoch;
+                at.current_url = position.first;
+                at.offset = position.second;
+                source->set_state(at);
+                auto sample = source->next_view();
+                if(sample) pin.add(push(sample, position));
+            }
+            started = buffer.size() > 0;
+            source->set_state(state);
+        }
+        bool get_position(string &, size_t &) {
+            return false;
+        }
+        shared_ptr<SampleView> peek_view() {
+            if(item) return item;
+            fill();
+            if(buffer.size() == 0) return nullptr;
+            size_t k = uniform_int_distribution<size_t>(0, buffer.size() - 1)(rng);
+            swap(buffer[k], buffer.back());
+            swap(positions[k], positions.back());
+            item = buffer.back();
+            item_position = move(positions.back());
+            buffer.pop_back();
+            positions.pop_back();
+            size_t n = sample_bytes(*item);
+            memory_budget().release(n);
+            bytes -= n;
+            pooled -= pool_bytes(*item);
+            return item;
+        }
+        shared_ptr<SampleView> next_view() {
+            shared_ptr<SampleView> result = peek_view();
+            item = nullptr;
+            return result;
+        }
+        shared_ptr<CompactSample> next_compact() {
+            return to_compact(next_view());
+        }
+        shared_ptr<LazySample> next_lazy() {
+            return to_lazy(next_view());
+        }
+        shared_ptr<Sample> peek() {
+            return to_sample(peek_view());
+        }
+        shared_ptr<Sample> next() {
+            return to_sample(next_view());
+        }
+        // Seeking discards the buffer and reshuffles from the new position.
+        bool seek_sample(size_t index) {
+            clear();
+            return source->seek_sample(index);
+        }
+        bool seek_key(const string &key) {
+            clear();
+            return source->seek_key(key);
+        }
+        vector<shared_ptr<Sample>> read_samples(size_t start, size_t end) {
+            clear();
+            return source->read_samples(start, end);
+        }
+    };
+
+    IWebDatasetReader *make_ShuffleReader(shared_ptr<IWebDatasetReader> source,
+                                          size_t capacity, size_t initial,
+                                          size_t max_bytes, unsigned seed) {
+        return new ShuffleReader(source, capacity, initial, max_bytes, seed);
+    }
+
+    class ThreadExecutor : public Executor {
+    private:
+        using Tasks = Channel<function<void()>>;
+        // Owned by the workers too, so that one that outlives the executor
+        // still has a queue to find closed.
+        shared_ptr<Tasks> tasks = make_shared<Tasks>(1024);
+        vector<thread> workers;
+        static void work(shared_ptr<Tasks> tasks) {
+            function<void()> task;
+            while(tasks->pop(task)) {
+                task();
+                task = nullptr;
+            }
+        }
+    public:
+        ThreadExecutor(int nthreads) {
+            for(int i=0; i<max(nthreads, 1); i++)
+                workers.push_back(thread(&ThreadExecutor::work, tasks));
+        }
+        // The last reference may be dropped by a task on one of our own
+        // threads, which cannot join itself; it is detached and finishes
+        // on the shared queue.
+        ~ThreadExecutor() {
+            tasks->close();
+            for(auto &worker : workers) {
+                if(worker.get_id() == this_thread::get_id()) worker.detach();
+                else worker.join();
+            }
+        }
+        bool submit(function<void()> task) {
+            return tasks->push(move(task));
+        }
+    };
+
+    Executor *make_Executor(int nthreads) {
+        return new ThreadExecutor(nthreads);
+    }
+
+    // The state lives in a shared object so that queued steps keep it alive
+    // after the AsyncReader itself is gone. At most one step runs at a
+    // time, since the source reader is not thread-safe.
+    struct AsyncState : enable_shared_from_this<AsyncState> {
+        shared_ptr<IWebDatasetReader> source;
+        shared_ptr<Executor> executor;
+        size_t ahead;
+        using Result = pair<shared_ptr<SampleView>, exception_ptr>;
+        mutex lock;
+        deque<Result> ready;
+        deque<IAsyncReader::Callback> waiters;
+        bool scheduled = false;
+        bool finished = false;
+        // Called with lock held.
+        void schedule() {
+            if(scheduled || finished || ready.size() >= ahead + waiters.size()) return;
+            scheduled = true;
+            auto self = shared_from_this();
+            if(!executor->submit([self] { self->step(); })) scheduled = false;
+        }
+        void step() {
+            Result result;
+            try {
+                result.first = source->next_view();
+            } catch(...) {
+                result.second = current_exception();
+            }
+            vector<pair<IAsyncReader::Callback, Result>> done;
+            {
+                lock_guard<mutex> guard(lock);
+                scheduled = false;
+                if(!result.first) finished = true;
+                ready.push_back(result);
+                while(!waiters.empty()) {
+                    Result next;
+                    if(!ready.empty()) {
+                        next = ready.front();
+                        ready.pop_front();
+                    } else if(!finished) {
+                        break;
+                    }
+                    done.emplace_back(move(waiters.front()), next);
+                    waiters.pop_front();
+                }
+                schedule();
+            }
+            for(auto &[callback, next] : done)
+                callback(next.first, next.second);
+        }
+        // Takes a buffered result, or queues callback and returns false.
+        bool poll(Result &result, const IAsyncReader::Callback &callback) {
+            lock_guard<mutex> guard(lock);
+            result = Result();
+            if(!ready.empty()) {
+                result = ready.front();
+                ready.pop_front();
+            } else if(!finished) {
+                waiters.push_back(callback);
+                schedule();
+                return false;
+            }
+            schedule();
+            return true;
+        }
+        void request(IAsyncReader::Callback callback) {
+            Result result;
+            if(poll(result, callback)) callback(result.first, result.second);
+        }
+    };
+
+    // Loops while samples are buffered instead of recursing, and waits
+    // with a copy of itself otherwise.
+    struct ForEach {
+        shared_ptr<AsyncState> state;
+        function<bool(shared_ptr<SampleView>)> on_sample;
+        function<void(exception_ptr)> on_done;
+        void operator()(shared_ptr<SampleView> sample, exception_ptr error) {
+            for(;;) {
+                if(error || !sample || !on_sample(sample)) {
+                    on_done(error);
+                    return;
+                }
+                AsyncState::Result result;
+                if(!state->poll(result, *this)) return;
+                sample = result.first;
+                error = result.second;
+            }
+        }
+    };
+
+    class AsyncReader : public IAsyncReader {
+    private:
+        shared_ptr<AsyncState> state = make_shared<AsyncState>();
+    public:
+        AsyncReader(shared_ptr<IWebDatasetReader> source, shared_ptr<Executor> executor, size_t ahead) {
+            state->source = source;
+            state->executor = executor;
+            state->ahead = max(ahead, size_t(1));
+        }
+        void next_async(Callback callback) {
+            state->request(move(callback));
+        }
+        future<shared_ptr<SampleView>> next_async() {
+            auto promise = make_shared<std::promise<shared_ptr<SampleView>>>();
+            state->request([promise](shared_ptr<SampleView> sample, exception_ptr error) {
+                if(error) promise->set_exception(error);
+                else promise->set_value(sample);
+            });
+            return promise->get_future();
+        }
+        void for_each_async(function<bool(shared_ptr<SampleView>)> on_sample,
+                            function<void(exception_ptr)> on_done) {
+            state->request(ForEach{state, on_sample, on_done});
+        }
+    };
+
+    IAsyncReader *make_AsyncReader(shared_ptr<IWebDatasetReader> source, shared_ptr<Executor> executor,
+                                   size_t ahead) {
+        return new AsyncReader(source, executor, ahead);
+    }
+
+    // Output streams for shards being written. As on the read side,
+    // compressors are wrapped with fopencookie; close reports any error.
+    struct Output {
+        FILE *stream = nullptr;
+        int (*close)(FILE *) = fclose;
+    };
+
+    ssize_t gz_write(void *cookie, const char *buf, size_t size) {
+        int n = gzwrite((gzFile)cookie, buf, unsigned(min(size, size_t(1) << 30)));
+        return n > 0 ? n : -1;
+    }
+
+    Output gz_create(const string &fname) {
+        gzFile gz = gzopen(fname.c_str(), "wb");
+        if(!gz) throw gopen_err();
+        gzbuffer(gz, 1 << 17);
+        cookie_io_functions_t io{nullptr, gz_write, nullptr, gz_close};
+        FILE *stream = fopencookie(gz, "w", io);
+        if(!stream) {
+            gzclose(gz);
+            throw gopen_err();
+        }
+        return Output{stream, fclose};
+    }
+
+#ifdef WDS_ZSTD
+    struct ZstdWriter {
+        FILE *file = nullptr;
+        ZSTD_CCtx *ctx = ZSTD_createCCtx();
+        string buffer = string(ZSTD_CStreamOutSize(), '\0');
+        ~ZstdWriter() {
+            ZSTD_freeCCtx(ctx);
+        }
+        bool compress(ZSTD_inBuffer &in, ZSTD_EndDirective mode) {
+            for(;;) {
+                ZSTD_outBuffer out{&buffer[0], buffer.size(), 0};
+                size_t left = ZSTD_compressStream2(ctx, &out, &in, mode);
+                if(ZSTD_isError(left)) return false;
+                if(fwrite(buffer.data(), 1, out.pos, file) != out.pos) return false;
+                if(mode == ZSTD_e_end ? left == 0 : in.pos == in.size) return true;
+            }
+        }
+    };
+
+    ssize_t zstd_write(void *cookie, const char *buf, size_t size) {
+        ZSTD_inBuffer in{buf, size, 0};
+        return ((ZstdWriter *)cookie)->compress(in, ZSTD_e_continue) ? size : -1;
+    }
+
+    int zstd_finish(void *cookie) {
+        unique_ptr<ZstdWriter> z((ZstdWriter *)cookie);
+        ZSTD_inBuffer in{nullptr, 0, 0};
+        bool ok = z->compress(in, ZSTD_e_end);
+        ok = fclose(z->file) == 0 && ok;
+        return ok ? 0 : -1;
+    }
+
+    Output zstd_create(const string &fname) {
+        auto z = make_unique<ZstdWriter>();
+        z->file = fopen(fname.c_str(), "wb");
+        if(!z->file) throw gopen_err();
+        cookie_io_functions_t io{nullptr, zstd_write, nullptr, zstd_finish};
+        FILE *stream = fopencookie(z.get(), "w", io);
+        if(!stream) {
+            fclose(z->file);
+            throw gopen_err();
+        }
+        z.release();
+        return Output{stream, fclose};
+    }
+#else
+    // Without libzstd, fall back to an external compressor.
+    Output zstd_create(const string &fname) {
+        FILE *stream = popen(("zstd -q -c > " + shell_quote(fname)).c_str(), "w");
+        if(!stream) throw gopen_err();
+        return Output{stream, pclose};
+    }
+#endif
+
+    Output create_output(const string &fname, const string &tmp) {
+        if(ends_with(fname, ".gz") || ends_with(fname, ".tgz")) return gz_create(tmp);
+        if(ends_with(fname, ".zst") || ends_with(fname, ".tzst")) return zstd_create(tmp);
+        FILE *stream = fopen(tmp.c_str(), "wb");
+        if(!stream) throw gopen_err();
+        return Output{stream, fclose};
+    }
+
+    Stage &writer_stats = stage("writer");
+
+    // Writes one shard after another, each to a temporary file that is
+    // renamed when the shard is complete. Shard numbers come from a counter
+    // shared by all writers for a pattern.
+    class ShardWriter {
+    private:
+        string pattern;
+        size_t max_bytes;
+        size_t max_count;
+        atomic<int> &shards;
+        unsigned mtime;
+        Output output;
+        string fname;
+        string tmp;
+        size_t bytes = 0;
+        size_t count = 0;
+        void put(const void *data, size_t size) {
+            if(fwrite(data, 1, size, output.stream) != size) throw write_err();
+            bytes += size;
+        }
+        void pad(size_t size) {
+            static const char zeros[512] = {0};
+            put(zeros, (512 - size % 512) % 512);
+        }
+        void header(const string &name, uint64_t size, char type) {
+            char block[512];
+            memset(block, 0, sizeof block);
+            memcpy(block, name.data(), min(name.size(), size_t(100)));
+            snprintf(block + 100, 8, "%07o", 0644);
+            snprintf(block + 108, 8, "%07o", 0);
+            snprintf(block + 116, 8, "%07o", 0);
+            snprintf(block + 124, 12, "%011llo", (unsigned long long)size);
+            snprintf(block + 136, 12, "%011o", mtime);
+            block[156] = type;
+            memcpy(block + 257, "ustar", 6);
+            memcpy(block + 263, "00", 2);
+            memset(block + 148, ' ', 8);
+            unsigned sum = 0;
+            for(int i=0; i<512; i++)
+                sum += (unsigned char)block[i];
+            snprintf(block + 148, 8, "%06o", sum);
+            put(block, sizeof block);
+        }
+        // A PAX record's length field counts its own digits.
+        static string pax_record(const string &key, const string &value) {
+            size_t length = key.size() + value.size() + 3;
+            size_t total = length + to_string(length).size();
+            if(to_string(total).size() != to_string(length).size()) total++;
+            return to_string(total) + " " + key + "=" + value + "\n";
+        }
+        void member(const string &name, const char *data, size_t size) {
+            const uint64_t max_octal = 077777777777ull;
+            if(name.size() > 100 || size > max_octal) {
+                string pax;
+                if(name.size() > 100) pax += pax_record("path", name);
+                if(size > max_octal) pax += pax_record("size", to_string(size));
+                header("././@PaxHeader", pax.size(), 'x');
+                put(pax.data(), pax.size());
+                pad(pax.size());
+            }
+            header(name, size > max_octal ? 0 : size, '0');
+            put(data, size);
+            pad(size);
+        }
+        void open() {
+            char buffer[4096];
+            snprintf(buffer, sizeof buffer, pattern.c_str(), shards++);
+            fname = buffer;
+            tmp = fname + ".tmp";
+            output = create_output(fname, tmp);
+            bytes = 0;
+            count = 0;
+        }
+        void abandon() {
+            if(!output.stream) return;
+            output.close(output.stream);
+            output.stream = nullptr;
+            unlink(tmp.c_str());
+        }
+    public:
+        ShardWriter(const string &pattern, size_t max_bytes, size_t max_count, atomic<int> &shards)
+            : pattern(pattern), max_bytes(max_bytes), max_count(max_count), shards(shards),
+              mtime(time(nullptr)) {}
+        ~ShardWriter() {
+            abandon();
+        }
+        void write(const Sample &sample) {
+            auto key = sample.find("__key__");
+            if(key == sample.end() || key->second.empty()) throw write_err();
+            if(output.stream && (count >= max_count || bytes >= max_bytes)) close();
+            if(!output.stream) open();
+            size_t start = bytes;
+            for(auto &[field, data] : sample) {
+                if(field.compare(0, 2, "__") == 0) continue;
+                member(key->second + field, data.data(), data.size());
+            }
+            count++;
+            writer_stats.items.add(1);
+            writer_stats.bytes.add(bytes - start);
+        }
+        void close() {
+            if(!output.stream) return;
+            static const char zeros[1024] = {0};
+            put(zeros, sizeof zeros);
+            FILE *stream = output.stream;
+            output.stream = nullptr;
+            if(output.close(stream) != 0 || rename(tmp.c_str(), fname.c_str()) != 0) {
+                unlink(tmp.c_str());
+                throw write_err();
+            }
+        }
+    };
+
+    class WebDatasetWriter : public IWebDatasetWriter {
+    private:
+        string pattern;
+        size_t max_bytes;
+        size_t max_count;
+        atomic<int> shards{0};
+        unique_ptr<ShardWriter> direct;
+        Channel<shared_ptr<Sample>> queue{64};
+        vector<thread> workers;
+        mutex error_lock;
+        exception_ptr error;
+        bool closed = false;
+        void work() {
+            try {
+                ShardWriter writer(pattern, max_bytes, max_count, shards);
+                shared_ptr<Sample> sample;
+                while(queue.pop(sample))
+                    writer.write(*sample);
+                writer.close();
+            } catch(...) {
+                lock_guard<mutex> guard(error_lock);
+                if(!error) error = current_exception();
+                queue.close();
+            }
+        }
+    public:
+        WebDatasetWriter(const string &pattern, size_t max_bytes, size_t max_count, int nthreads)
+            : pattern(pattern), max_bytes(max_bytes), max_count(max_count) {
+            if(nthreads <= 0)
+                direct.reset(new ShardWriter(pattern, max_bytes, max_count, shards));
+            for(int i=0; i<nthreads; i++)
+                workers.push_back(thread(&WebDatasetWriter::work, this));
+        }
+        ~WebDatasetWriter() {
+            try {
+                close();
+            } catch(...) {
+            }
+        }
+        void write(shared_ptr<Sample> sample) {
+            if(closed) throw write_err();
+            if(direct) {
+                direct->write(*sample);
+            } else if(!queue.push(sample)) {
+                lock_guard<mutex> guard(error_lock);
+                if(error) rethrow_exception(error);
+                throw write_err();
+            }
+        }
+        // Waits for the writer threads and finishes the last shards.
+        void close() {
+            if(closed) return;
+            closed = true;
+            queue.close();
+            for(auto &worker : workers)
+                worker.join();
+            if(direct) direct->close();
+            if(error) rethrow_exception(error);
+        }
+    };
+
+    IWebDatasetWriter *make_WebDatasetWriter(const string &pattern, size_t max_bytes,
+                                             size_t max_count, int nthreads) {
+        return new WebDatasetWriter(pattern, max_bytes, max_count, nthreads);
     }
 }
@@ -1,29 +1,391 @@
 #include <stdio.h>
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
+#include <string_view>
 #include <exception>
 #include <memory>
 #include <functional>
+#include <future>
+
+#include "stats.h"
 
 namespace webdataset {
 
-    class webdataset_error : public std::exception {};
-    class bad_tar_format : public webdataset_error {};
-    class short_tar_read : public webdataset_error {};
-    class gopen_err : public webdataset_error {};
+    // Readers fill in the shard and byte offset where an error happened;
+    // offset is size_t(-1) when unknown.
+    class webdataset_error : public std::exception {
+    public:
+        explicit webdataset_error(const char *message="webdataset error")
+            : message(message), text(message) {}
+        const char *what() const noexcept { return text.c_str(); }
+        void set_context(const std::string &url, size_t offset) {
+            this->url = url;
+            this->offset = offset;
+            text = message + " in " + url;
+            if(offset != size_t(-1)) text += " at offset " + std::to_string(offset);
+        }
+        std::string message;
+        std::string url;
+        size_t offset = size_t(-1);
+    private:
+        std::string text;
+    };
+    class bad_tar_format : public webdataset_error {
+    public:
+        bad_tar_format() : webdataset_error("bad tar format") {}
+    };
+    class short_tar_read : public webdataset_error {
+    public:
+        short_tar_read() : webdataset_error("short tar read") {}
+    };
+    class gopen_err : public webdataset_error {
+    public:
+        gopen_err() : webdataset_error("cannot open") {}
+    };
+    class seek_err : public webdataset_error {
+    public:
+        seek_err() : webdataset_error("cannot seek") {}
+    };
+    class split_err : public webdataset_error {
+    public:
+        split_err() : webdataset_error("bad shard split") {}
+    };
+    class write_err : public webdataset_error {
+    public:
+        write_err() : webdataset_error("cannot write") {}
+    };
+    class state_err : public webdataset_error {
+    public:
+        explicit state_err(const char *message="bad reader state") : webdataset_error(message) {}
+    };
+
+    // What a reader does when a shard fails: rethrow, skip the rest of the
+    // shard, or also resynchronize past corrupt member headers by scanning
+    // for the next valid one. Opening a shard is first retried open_retries
+    // times, waiting backoff seconds and doubling the wait each time.
+    // Handled errors are counted in the "errors" stats.
+    struct ErrorPolicy {
+        enum Action { fail, skip_shard, skip_member };
+        Action action = fail;
+        int open_retries = 0;
+        double backoff = 0.1;
+    };
 
     using Sample = std::map<std::string, std::string>;
 
+    // An immutable byte range that keeps its backing storage alive.
+    // Payloads from memory-mapped shards point straight into the mapping.
+    class Bytes {
+    public:
+        Bytes() = default;
+        Bytes(std::string s) {
+            auto buffer = std::make_shared<std::string>(std::move(s));
+            ptr = buffer->data();
+            len = buffer->size();
+            owner = std::move(buffer);
+        }
+        Bytes(std::shared_ptr<const void> owner, const char *ptr, size_t len)
+            : owner(std::move(owner)), ptr(ptr), len(len) {}
+        const char *data() const { return ptr; }
+        size_t size() const { return len; }
+        bool empty() const { return len == 0; }
+        std::string_view view() const { return std::string_view(ptr, len); }
+        operator std::string_view() const { return view(); }
+        std::string str() const { return std::string(ptr, len); }
+    private:
+        std::shared_ptr<const void> owner;
+        const char *ptr = nullptr;
+        size_t len = 0;
+    };
+
+    using SampleView = std::map<std::string, Bytes>;
+
+    struct ShardFile;
+
+    // A payload that is read from its shard the first time get() is
+    // called. Copies share the loaded data.
+    class LazyBytes {
+    public:
+        LazyBytes() = default;
+        explicit LazyBytes(const Bytes &bytes);
+        LazyBytes(std::shared_ptr<ShardFile> file, size_t offset, size_t size);
+        size_t size() const { return length; }
+        const Bytes &get() const;
+    private:
+        struct State;
+        std::shared_ptr<State> state;
+        size_t length = 0;
+    };
+
+    using LazySample = std::map<std::string, LazyBytes>;
+
+    // A sample whose key, extensions and payloads share one contiguous
+    // arena. Fields are kept in a small inline table in read order and
+    // looked up by linear scan, which beats a tree for a handful of fields.
+    class CompactSample {
+    public:
+        CompactSample() = default;
+        CompactSample(const CompactSample &) = delete;
+        CompactSample &operator=(const CompactSample &) = delete;
+        std::string_view key() const { return view(key_field); }
+        size_t size() const { return nfields; }
+        std::string_view name(size_t i) const { return view(field(i).name); }
+        std::string_view data(size_t i) const { return view(field(i).data); }
+        bool find(std::string_view ext, std::string_view &data) const;
+        size_t bytes() const { return used; }
+        void reserve(size_t size);
+        void set_key(std::string_view key);
+        // Adds a field and returns the arena space for its payload.
+        char *append(std::string_view ext, size_t size);
+        void add(std::string_view ext, std::string_view data);
+    private:
+        struct Span {
+            size_t offset = 0;
+            size_t size = 0;
+        };
+        struct Field {
+            Span name;
+            Span data;
+        };
+        static constexpr size_t ninline = 8;
+        Field inline_fields[ninline];
+        std::vector<Field> extra_fields;
+        size_t nfields = 0;
+        Span key_field;
+        std::unique_ptr<char[]> arena;
+        size_t used = 0;
+        size_t capacity = 0;
+        char *allocate(size_t size);
+        const Field &field(size_t i) const {
+            return i < ninline ? inline_fields[i] : extra_fields[i - ninline];
+        }
+        std::string_view view(Span span) const {
+            return std::string_view(arena.get() + span.offset, span.size);
+        }
+    };
+
+    // Samples stored column by column: each field's payloads are packed
+    // into one buffer, and sample i's payload is data[offsets[i], offsets[i+1]).
+    // Samples lacking a field get an empty entry in that column.
+    struct Batch {
+        struct Column {
+            std::string data;
+            std::vector<size_t> offsets{0};
+            std::string_view get(size_t i) const {
+                return std::string_view(data.data() + offsets[i], offsets[i + 1] - offsets[i]);
+            }
+        };
+        std::vector<std::string> keys;
+        std::map<std::string, Column> columns;
+        size_t size() const { return keys.size(); }
+    };
+
+    std::shared_ptr<Batch> collate(const std::vector<std::shared_ptr<Sample>> &samples);
+    std::shared_ptr<Batch> collate(const std::vector<std::shared_ptr<SampleView>> &samples);
+
+    // One regular-file member of a tar shard: the byte offset of its
+    // header, its payload size, and its full name.
+    struct IndexEntry {
+        size_t offset;
+        size_t size;
+        std::string name;
+    };
+
+    using ShardIndex = std::vector<IndexEntry>;
+
+    // How local, uncompressed shards are read when not memory-mapped:
+    // plain stdio, or io_uring with depth reads of chunk_size bytes kept in
+    // flight. Falls back to stdio where io_uring is unavailable.
+    enum class IOBackend { stdio, uring };
+    void set_io_backend(IOBackend backend, size_t chunk_size=1 << 20, int depth=4);
+
+    // Payloads read from streams live in pooled buffers that are reused
+    // once the last sample referring to them is dropped. Readers block
+    // while max_bytes of buffers are in use by other threads; a thread's
+    // own samples under assembly, batches and shuffle buffers never make it
+    // wait on itself and are allowed past the ceiling instead. Up to
+    // max_cached bytes of free buffers are kept for reuse.
+    void set_buffer_pool(size_t max_bytes, size_t max_cached=size_t(64) << 20);
+
+    // Bounds the payload bytes held at once by pipeline queues, parallel
+    // reader queues and shuffle buffers. A full budget blocks producers,
+    // except that an empty queue always takes one item, and shrinks
+    // shuffle buffers. Unlimited by default.
+    void set_memory_budget(size_t max_bytes);
+
+    // Keeps copies of pipe: shards in dir, evicting the least recently used
+    // ones beyond max_bytes. A shard is cached while it is first read and
+    // later opened from disk; an empty dir disables the cache.
+    void set_cache(const std::string &dir, size_t max_bytes);
+
+    // Sidecar indexes live next to the shard as <url>.idx.
+    ShardIndex scan_index(const std::string &url);
+    ShardIndex load_index(const std::string &url);
+    void save_index(const std::string &url, const ShardIndex &index);
+
+    // Iterates over the regular-file members of a single shard. Payloads
+    // are only read when data() is called.
+    class ITarReader {
+    public:
+        virtual ~ITarReader() {}
+        virtual const IndexEntry *peek() = 0;
+        virtual Bytes data() = 0;
+        virtual void next() = 0;
+    };
+
+    ITarReader *make_TarReader(const std::string &url, bool use_mmap=false);
+
+    // Expands "{000..123}" ranges (zero-padded to the width of the first
+    // bound) and "{a,b,c}" alternatives; braces may nest or repeat.
+    std::vector<std::string> expand_urls(const std::string &spec);
+
+    // One consumer out of world_size ranks with num_workers loaders each.
+    // Every consumer must use the same seed so that their subsets partition
+    // the shard list. With even, shards are repeated as needed so that all
+    // consumers get the same number of shards.
+    struct ShardSplit {
+        int rank = 0;
+        int world_size = 1;
+        int worker_id = 0;
+        int num_workers = 1;
+        uint64_t seed = 0;
+        bool shuffle = true;
+        bool even = false;
+    };
+
+    // The shards of urls read by one consumer in the given epoch. Counts
+    // differ by at most one shard between consumers and between ranks.
+    std::vector<std::string> split_shards(const std::vector<std::string> &urls,
+                                          const ShardSplit &split, uint64_t epoch);
+
+    // A refill function that yields the split for first_epoch,
+    // first_epoch + 1, ... on successive calls.
+    std::function<void(std::vector<std::string> &)> shard_refill(
+        const std::vector<std::string> &urls, const ShardSplit &split, uint64_t first_epoch=0);
+
+    // Where a reader is in its stream of samples: the shards still to be
+    // read, the shard being read with the byte offset of its next sample
+    // (current_url is empty between shards), the epoch of the shard list,
+    // and the state of the shuffle generator, if any.
+    struct ReaderState {
+        std::vector<std::string> urls;
+        std::string current_url;
+        size_t offset = 0;
+        uint64_t epoch = 0;
+        std::string rng;
+        // Shard and offset of each sample held in a shuffle buffer.
+        std::vector<std::pair<std::string, size_t>> buffered;
+    };
+
+    // A line-based text form of a ReaderState, for checkpoints.
+    std::string save_state(const ReaderState &state);
+    ReaderState load_state(const std::string &text);
+
     class IWebDatasetReader {
     public:
+        virtual ~IWebDatasetReader() {}
         virtual void add_url(const std::string &) = 0;
         virtual void set_urls(const std::vector<std::string> &) = 0;
         virtual void set_refill(std::function<void(std::vector<std::string> &)>) = 0;
         virtual std::shared_ptr<Sample> peek() = 0;
         virtual std::shared_ptr<Sample> next() = 0;
+        virtual void set_mmap(bool) = 0;
+        virtual std::shared_ptr<SampleView> peek_view() = 0;
+        virtual std::shared_ptr<SampleView> next_view() = 0;
+        virtual std::shared_ptr<CompactSample> next_compact() = 0;
+        virtual bool seek_sample(size_t) = 0;
+        virtual bool seek_key(const std::string &) = 0;
+        virtual std::vector<std::shared_ptr<Sample>> read_samples(size_t, size_t) = 0;
+        // Only members with these extensions (e.g. ".jpg") are read; the
+        // others are skipped without reading their payloads. Empty keeps
+        // all fields.
+        virtual void set_fields(const std::set<std::string> &) = 0;
+        // Payloads of local shards read without mmap are loaded on first
+        // access; other sources, and readers that buffer samples, return
+        // them already loaded.
+        virtual std::shared_ptr<LazySample> next_lazy() = 0;
+        virtual void set_error_policy(const ErrorPolicy &) = 0;
+        // Reads the split of urls for epoch, then for epoch + 1, and so on.
+        virtual void set_shards(const std::vector<std::string> &urls, const ShardSplit &split,
+                                uint64_t epoch=0) = 0;
+        // A restored reader continues with the sample that followed the
+        // checkpoint, seeking straight to it; streams that cannot seek are
+        // read forward to the offset. Readers that keep several shards open
+        // throw state_err.
+        virtual ReaderState get_state() = 0;
+        virtual void set_state(const ReaderState &) = 0;
+        // The shard and offset of the sample peek_view() returns; false
+        // when there is none or the reader cannot tell.
+        virtual bool get_position(std::string &url, size_t &offset) = 0;
     };
 
     IWebDatasetReader *make_WebDatasetReader();
 
+    // Reads up to max_samples samples, stopping early once max_bytes of
+    // payload have been collected; returns nullptr at the end of the data.
+    std::shared_ptr<Batch> next_batch(IWebDatasetReader &reader, size_t max_samples,
+                                      size_t max_bytes=size_t(-1));
+    IWebDatasetReader *make_ParallelWebDatasetReader(int nshards, bool randomize=false, unsigned seed=0);
+
+    // Wraps a reader in a streaming shuffle buffer holding at most capacity
+    // samples and max_bytes of payload. Output starts once initial samples
+    // are buffered. Its state holds the generator, the source position and
+    // the positions of the buffered samples, which a restore reads back.
+    IWebDatasetReader *make_ShuffleReader(std::shared_ptr<IWebDatasetReader> source,
+                                          size_t capacity, size_t initial=0,
+                                          size_t max_bytes=size_t(-1), unsigned seed=0);
+
+    // A fixed pool of threads running submitted tasks in FIFO order.
+    // Tasks submitted after destruction has begun are dropped.
+    class Executor {
+    public:
+        virtual ~Executor() {}
+        virtual bool submit(std::function<void()> task) = 0;
+    };
+
+    Executor *make_Executor(int nthreads);
+
+    // Reads samples from a source reader on a shared Executor, so that
+    // many readers can make progress on a few threads. Each step reads one
+    // sample, which lets readers interleave; up to ahead samples are
+    // prefetched. Callbacks run on an executor thread, or inline when a
+    // sample is already buffered. After the end of the data or an error,
+    // every request gets nullptr.
+    class IAsyncReader {
+    public:
+        using Callback = std::function<void(std::shared_ptr<SampleView>, std::exception_ptr)>;
+        virtual ~IAsyncReader() {}
+        virtual void next_async(Callback callback) = 0;
+        virtual std::future<std::shared_ptr<SampleView>> next_async() = 0;
+        // Calls on_sample for every sample until it returns false or the
+        // data ends, then on_done with the error, if any.
+        virtual void for_each_async(std::function<bool(std::shared_ptr<SampleView>)> on_sample,
+                                    std::function<void(std::exception_ptr)> on_done) = 0;
+    };
+
+    IAsyncReader *make_AsyncReader(std::shared_ptr<IWebDatasetReader> source,
+                                   std::shared_ptr<Executor> executor, size_t ahead=4);
+
+    // Writes each sample as tar members named <__key__><field>; fields
+    // whose names start with "__" are not written.
+    class IWebDatasetWriter {
+    public:
+        virtual ~IWebDatasetWriter() {}
+        virtual void write(std::shared_ptr<Sample>) = 0;
+        virtual void close() = 0;
+    };
+
+    // pattern is a printf format for the shard number, e.g. "out-%06d.tar";
+    // a .gz, .tgz, .zst or .tzst suffix compresses the shards. A new shard
+    // is started once the current one holds max_count samples or max_bytes
+    // of tar data. Shards appear under their final name only when complete.
+    // With nthreads > 0, that many threads fill separate shards from a
+    // shared queue and sample order across shards is not kept; with 0,
+    // write() writes in the calling thread.
+    IWebDatasetWriter *make_WebDatasetWriter(const std::string &pattern,
+                                             size_t max_bytes=size_t(-1),
+                                             size_t max_count=size_t(-1), int nthreads=0);
+
 }
@@ -0,0 +1,691 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "channel.h"
+#include "webdataset.h"
+
+namespace webdataset {
+
+    template <class T>
+    using ChannelP = std::shared_ptr<Channel<T>>;
+
+    // Payload bytes of a channel item, for byte-based backpressure. Only
+    // samples and batches count; other items, such as URLs, are free.
+    template <class T>
+    size_t item_bytes(const T &) {
+        return 0;
+    }
+    inline size_t item_bytes(const std::shared_ptr<Sample> &sample) {
+        size_t bytes = 0;
+        if(sample)
+            for(auto &[k, v] : *sample)
+                bytes += v.size();
+        return bytes;
+    }
+    inline size_t item_bytes(const std::shared_ptr<Batch> &batch) {
+        size_t bytes = 0;
+        if(batch)
+            for(auto &[k, column] : batch->columns)
+                bytes += column.data.size();
+        return bytes;
+    }
+
+    template <class T>
+    ChannelP<T> make_channel(size_t capacity) {
+        return std::make_shared<Channel<T>>(capacity, static_cast<size_t (*)(const T &)>(item_bytes));
+    }
+
+    // A pipeline stage as seen by the Scheduler.
+    class Schedulable {
+    public:
+        virtual ~Schedulable() {}
+        // Does one unit of work without blocking; false if none was possible.
+        virtual bool step() = 0;
+        // True if step() can make progress now.
+        virtual bool ready() = 0;
+        // True once the stage will never have work again.
+        virtual bool exhausted() = 0;
+        // Called once, after the stage is exhausted and no step is running.
+        virtual void complete() = 0;
+    };
+
+    // Runs the steps of many stages on one pool of threads. A worker runs a
+    // stage it has claimed for up to quantum steps. If the stage still has
+    // work, the worker keeps its claim and, below the stage's concurrency
+    // limit, also queues a second claim that idle workers can steal. A
+    // worker with nothing of its own and nothing to steal claims the
+    // highest-priority ready stage. Threads therefore gather on whichever
+    // stage has input and room for output, i.e. the bottleneck. Stages'
+    // channels wake idle workers when items move.
+    class Scheduler {
+    public:
+        explicit Scheduler(int nthreads, int quantum=64) : quantum(std::max(quantum, 1)) {
+            nthreads = std::max(nthreads, 1);
+            for(int i=0; i<nthreads; i++)
+                queues.emplace_back(new Queue());
+            for(int i=0; i<nthreads; i++)
+                threads.push_back(std::thread(&Scheduler::work, this, i));
+        }
+        ~Scheduler() {
+            stopping = true;
+            wake.notify_all();
+            for(auto &thread : threads)
+                thread.join();
+        }
+        void add(Schedulable *stage, int limit, int priority=0) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                entries.emplace_back(new Entry(stage, std::max(limit, 1), priority));
+                std::stable_sort(entries.begin(), entries.end(), [](auto &a, auto &b) {
+                    return a->priority > b->priority;
+                });
+            }
+            wake.notify_all();
+        }
+        // Withdraws a stage and waits until none of its steps, and not its
+        // completion, is running.
+        void remove(Schedulable *stage) {
+            Entry *entry = nullptr;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for(auto &e : entries)
+                    if(e->stage == stage) entry = e.get();
+            }
+            if(!entry) return;
+            entry->removed = true;
+            for(auto &queue : queues) {
+                std::lock_guard<std::mutex> guard(queue->lock);
+                auto &claims = queue->claims;
+                for(auto it = claims.begin(); it != claims.end(); ) {
+                    if(*it == entry) {
+                        entry->active--;
+                        it = claims.erase(it);
+                    } else {
+                        it++;
+                    }
+                }
+            }
+            std::unique_lock<std::mutex> guard(lock);
+            idle.wait(guard, [&] { return entry->active == 0; });
+            entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                         [&](auto &e) { return e.get() == entry; }),
+                          entries.end());
+        }
+        EventCount &events() {
+            return wake;
+        }
+    private:
+        struct Entry {
+            Entry(Schedulable *stage, int limit, int priority)
+                : stage(stage), limit(limit), priority(priority) {}
+            Schedulable *stage;
+            int limit;
+            int priority;
+            std::atomic<int> active{0};
+            std::atomic<bool> removed{false};
+            std::atomic<bool> completed{false};
+        };
+        struct Queue {
+            std::mutex lock;
+            std::deque<Entry *> claims;
+        };
+        int quantum;
+        std::mutex lock;
+        std::condition_variable idle;
+        std::vector<std::unique_ptr<Entry>> entries;
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> threads;
+        EventCount wake;
+        std::atomic<bool> stopping{false};
+        bool try_acquire(Entry *entry) {
+            int active = entry->active;
+            while(active < entry->limit)
+                if(entry->active.compare_exchange_weak(active, active + 1)) return true;
+            return false;
+        }
+        void push(size_t me, Entry *entry) {
+            std::lock_guard<std::mutex> guard(queues[me]->lock);
+            queues[me]->claims.push_back(entry);
+        }
+        // Own claims are taken newest first, stolen ones oldest first.
+        Entry *take(size_t me) {
+            for(size_t i=0; i<queues.size(); i++) {
+                Queue &queue = *queues[(me + i) % queues.size()];
+                std::lock_guard<std::mutex> guard(queue.lock);
+                if(queue.claims.empty()) continue;
+                Entry *entry;
+                if(i == 0) {
+                    entry = queue.claims.back();
+                    queue.claims.pop_back();
+                } else {
+                    entry = queue.claims.front();
+                    queue.claims.pop_front();
+                }
+                return entry;
+            }
+            return nullptr;
+        }
+        // Also completes exhausted stages that nothing is running; the
+        // completion holds the entry like a step does. Every entry is
+        // checked for completion, whichever one is claimed.
+        Entry *claim() {
+            std::vector<Entry *> finished;
+            Entry *result = nullptr;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for(auto &e : entries) {
+                    Entry *entry = e.get();
+                    if(entry->removed || entry->completed) continue;
+                    int none = 0;
+                    if(entry->active == 0 && entry->stage->exhausted()) {
+                        if(entry->active.compare_exchange_strong(none, 1)) {
+                            entry->completed = true;
+                            finished.push_back(entry);
+                        }
+                    } else if(!result && entry->stage->ready() && try_acquire(entry)) {
+                        result = entry;
+                    }
+                }
+            }
+            for(auto entry : finished) {
+                entry->stage->complete();
+                release(entry);
+            }
+            return result;
+        }
+        // Under the lock, so that remove() cannot miss the last release.
+        void release(Entry *entry) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if(--entry->active == 0) idle.notify_all();
+            }
+            wake.notify();
+        }
+        void run(size_t me, Entry *entry) {
+            bool progress = false;
+            if(!entry->removed) {
+                for(int i=0; i<quantum && entry->stage->step(); i++)
+                    progress = true;
+            }
+            if(progress && !entry->removed && entry->stage->ready()) {
+                if(try_acquire(entry)) {
+                    push(me, entry);
+                    wake.notify();
+                }
+                push(me, entry);
+                return;
+            }
+            release(entry);
+        }
+        void work(size_t me) {
+            for(;;) {
+                Entry *entry = take(me);
+                if(!entry) entry = claim();
+                if(!entry) {
+                    uint64_t key = wake.prepare();
+                    entry = take(me);
+                    if(!entry) entry = claim();
+                    if(!entry) {
+                        if(stopping) {
+                            wake.cancel();
+                            return;
+                        }
+                        wake.wait(key);
+                        continue;
+                    }
+                    wake.cancel();
+                }
+                run(me, entry);
+            }
+        }
+    };
+
+
+    // Worker threads block on the channels instead of polling them. Closing
+    // the input with close() drains the stage: once the last worker has
+    // finished, the output is closed and get() returns false. An exception
+    // thrown by a worker stops the stage and is rethrown from get() once the
+    // output has drained. Alternatively, a stage that implements poll()
+    // can run on a shared Scheduler.
+    template <class IN, class OUT>
+    class BaseProcessor : public Schedulable {
+    public:
+        virtual ~BaseProcessor() {}
+        bool add(IN &in) {
+            return running && inch->push(std::move(in));
+        }
+        void close() {
+            inch->close();
+        }
+        bool get(OUT &out, double timeout=1e33) {
+            if(outch->pop(out, timeout)) return true;
+            if(outch->is_closed() && error) std::rethrow_exception(error);
+            return false;
+        }
+        // Reads this stage's input from the output of another stage.
+        template <class T>
+        void connect(BaseProcessor<T, IN> &source) {
+            inch = source.output();
+        }
+        ChannelP<OUT> output() {
+            return outch;
+        }
+        // Bounds the output queue by items and by payload bytes; all queues
+        // also share the memory budget. Call before connect() and start().
+        void set_capacity(size_t items, size_t max_bytes=size_t(-1)) {
+            ChannelP<OUT> channel = make_channel<OUT>(std::max(items, size_t(1)));
+            channel->set_max_bytes(max_bytes);
+            channel->set_stats(outch->get_stats());
+            outch = channel;
+        }
+        // Records this stage's queues as <name>.in and <name>.out in the
+        // stats; an input shared through connect() keeps its upstream name.
+        void set_name(const std::string &name) {
+            if(!inch->get_stats()) inch->set_stats(&stage(name + ".in"));
+            outch->set_stats(&stage(name + ".out"));
+        }
+        void start(int nthread) {
+            active += nthread;
+            for(int i=0; i<nthread; i++) {
+                jobs.push_back(std::thread(&BaseProcessor::run, this));
+            }
+        }
+        // Runs the stage on a scheduler, with at most max_concurrency steps
+        // at once; higher priorities are served first.
+        void start(Scheduler &scheduler, int max_concurrency, int priority=0) {
+            this->scheduler = &scheduler;
+            inch->set_observer(&scheduler.events());
+            outch->set_observer(&scheduler.events());
+            scheduler.add(this, max_concurrency, priority);
+        }
+        void finish() {
+            running = false;
+            interrupt();
+            if(scheduler) scheduler->remove(this);
+            scheduler = nullptr;
+            inch->close();
+            outch->close();
+            for(size_t i=0; i<jobs.size(); i++) {
+                jobs[i].join();
+            }
+            jobs.clear();
+        }
+        virtual void loop() = 0;
+        bool step() final {
+            try {
+                return poll();
+            } catch(...) {
+                fail(std::current_exception());
+                return false;
+            }
+        }
+        // A closed output means that downstream has stopped, so the stage
+        // is done whatever it still holds.
+        bool ready() final {
+            if(!running || outch->is_closed() || outch->full()) return false;
+            return nstalled > 0 || actionable() || (accepting() && !inch->empty());
+        }
+        bool exhausted() final {
+            if(!running || outch->is_closed()) return true;
+            return inch->is_closed() && inch->empty() && nstalled == 0 && !busy();
+        }
+        // Closing the input passes a stop on to upstream stages.
+        void complete() final {
+            inch->close();
+            outch->close();
+        }
+    protected:
+        std::atomic<bool> running{true};
+        std::atomic<int> active{0};
+        ChannelP<IN> inch = make_channel<IN>(100);
+        ChannelP<OUT> outch = make_channel<OUT>(100);
+        std::vector<std::thread> jobs;
+        std::mutex error_lock;
+        std::exception_ptr error;
+        Scheduler *scheduler = nullptr;
+        std::mutex stall_lock;
+        std::deque<OUT> stalled;
+        std::atomic<size_t> nstalled{0};
+        void run() {
+            try {
+                loop();
+            } catch(...) {
+                fail(std::current_exception());
+            }
+            if(--active == 0) outch->close();
+        }
+        void fail(std::exception_ptr e) {
+            {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if(!error) error = e;
+            }
+            running = false;
+            inch->close();
+        }
+        bool recv(IN &in) {
+            return running && inch->pop(in);
+        }
+        bool send(OUT &out) {
+            return running && outch->push(std::move(out));
+        }
+        // Scheduler mode. poll() does one unit of work without blocking and
+        // returns false if there was none; outputs that do not fit into
+        // the channel wait in order behind earlier ones, and a stage should
+        // not take new input while any are waiting.
+        virtual bool poll() {
+            throw std::logic_error("stage cannot run on a Scheduler");
+        }
+        // Whether new input may be taken.
+        virtual bool accepting() {
+            return true;
+        }
+        // Whether there is work that needs no new input.
+        virtual bool actionable() {
+            return false;
+        }
+        // Whether the stage holds state that will still produce output.
+        virtual bool busy() {
+            return false;
+        }
+        // Wakes workers waiting on the stage's own conditions once running
+        // is false.
+        virtual void interrupt() {}
+        bool try_recv(IN &in) {
+            return running && inch->try_pop(in);
+        }
+        void offer(OUT &out) {
+            std::lock_guard<std::mutex> guard(stall_lock);
+            if(stalled.empty() && outch->try_push(out)) return;
+            stalled.push_back(std::move(out));
+            nstalled = stalled.size();
+        }
+        // Sends waiting outputs; true if any was sent.
+        bool flush() {
+            if(nstalled == 0) return false;
+            std::lock_guard<std::mutex> guard(stall_lock);
+            bool sent = false;
+            while(!stalled.empty() && outch->try_push(stalled.front())) {
+                stalled.pop_front();
+                sent = true;
+            }
+            nstalled = stalled.size();
+            return sent;
+        }
+    };
+
+
+    // Reads every sample of each input URL. Each worker thread has its own
+    // reader, so several shards can be read at once; on a scheduler, each
+    // step reads one sample with one of a set of readers.
+    class DatasetReader : public BaseProcessor<std::string, std::shared_ptr<Sample>> {
+    private:
+        struct Cursor {
+            std::unique_ptr<IWebDatasetReader> reader{make_WebDatasetReader()};
+            bool open = false;
+        };
+        std::mutex cursor_lock;
+        std::vector<std::unique_ptr<Cursor>> idle;
+        std::atomic<int> idle_open{0};
+        std::atomic<int> open{0};
+        void loop() {
+            std::unique_ptr<IWebDatasetReader> wds(make_WebDatasetReader());
+            while(running) {
+                std::string in;
+                if(!recv(in)) break;
+                wds->add_url(in);
+                for(;;) {
+                    std::shared_ptr<Sample> sample = wds->next();
+                    if(!sample) break;
+                    if(!send(sample)) break;
+                }
+            }
+        }
+        // Prefers a reader that is in the middle of a shard.
+        std::unique_ptr<Cursor> take_cursor() {
+            std::lock_guard<std::mutex> guard(cursor_lock);
+            for(auto &cursor : idle) {
+                if(!cursor->open) continue;
+                std::swap(cursor, idle.back());
+                break;
+            }
+            if(idle.empty()) return std::unique_ptr<Cursor>(new Cursor());
+            std::unique_ptr<Cursor> cursor = std::move(idle.back());
+            idle.pop_back();
+            if(cursor->open) idle_open--;
+            return cursor;
+        }
+        void give_back(std::unique_ptr<Cursor> cursor) {
+            std::lock_guard<std::mutex> guard(cursor_lock);
+            if(cursor->open) idle_open++;
+            idle.push_back(std::move(cursor));
+        }
+        bool poll() {
+            bool progress = flush();
+            if(nstalled > 0) return progress;
+            std::unique_ptr<Cursor> cursor = take_cursor();
+            if(!cursor->open) {
+                std::string url;
+                if(!try_recv(url)) {
+                    give_back(std::move(cursor));
+                    return progress;
+                }
+                cursor->reader->add_url(url);
+                cursor->open = true;
+                open++;
+            }
+            std::shared_ptr<Sample> sample = cursor->reader->next();
+            if(sample) {
+                offer(sample);
+            } else {
+                cursor->open = false;
+                open--;
+            }
+            give_back(std::move(cursor));
+            return true;
+        }
+        bool actionable() {
+            return idle_open > 0;
+        }
+        bool busy() {
+            return open > 0;
+        }
+    };
+
+
+    // Groups samples into batches of up to batch_size samples or max_bytes
+    // of payload; the last batch of the stream may be smaller.
+    class BatchProcessor : public BaseProcessor<std::shared_ptr<Sample>, std::shared_ptr<Batch>> {
+    public:
+        BatchProcessor(size_t batch_size, size_t max_bytes=size_t(-1))
+            : batch_size(std::max(batch_size, size_t(1))), max_bytes(max_bytes) {}
+    private:
+        size_t batch_size;
+        size_t max_bytes;
+        std::mutex batch_lock;
+        std::vector<std::shared_ptr<Sample>> partial;
+        size_t partial_bytes = 0;
+        std::atomic<bool> has_partial{false};
+        void loop() {
+            std::vector<std::shared_ptr<Sample>> samples;
+            size_t bytes = 0;
+            for(;;) {
+                std::shared_ptr<Sample> sample;
+                bool more = recv(sample);
+                if(more) {
+                    bytes += item_bytes(sample);
+                    samples.push_back(sample);
+                }
+                if(samples.size() > 0 && (!more || samples.size() >= batch_size || bytes >= max_bytes)) {
+                    std::shared_ptr<Batch> batch = collate(samples);
+                    samples.clear();
+                    bytes = 0;
+                    if(!send(batch)) break;
+                }
+                if(!more) break;
+            }
+        }
+        // Samples are gathered under a lock; collation happens outside it.
+        bool poll() {
+            bool progress = flush();
+            if(nstalled > 0) return progress;
+            std::shared_ptr<Sample> sample;
+            bool got = try_recv(sample);
+            std::vector<std::shared_ptr<Sample>> samples;
+            {
+                std::lock_guard<std::mutex> guard(batch_lock);
+                if(got) {
+                    partial_bytes += item_bytes(sample);
+                    partial.push_back(sample);
+                }
+                bool last = !got && inch->is_closed() && inch->empty();
+                if(partial.size() > 0 && (last || partial.size() >= batch_size || partial_bytes >= max_bytes)) {
+                    samples.swap(partial);
+                    partial_bytes = 0;
+                }
+                has_partial = partial.size() > 0;
+            }
+            if(samples.size() > 0) {
+                std::shared_ptr<Batch> batch = collate(samples);
+                offer(batch);
+                return true;
+            }
+            return got || progress;
+        }
+        bool actionable() {
+            return has_partial && inch->is_closed() && inch->empty();
+        }
+        bool busy() {
+            return has_partial;
+        }
+    };
+
+
+    // Applies a function to every input on a pool of worker threads. In
+    // ordered mode inputs are numbered as they are received, and results are
+    // held back until all earlier results have been sent; a worker stays at
+    // most window items ahead of the oldest unsent result.
+    template <class IN, class OUT>
+    class MapProcessor : public BaseProcessor<IN, OUT> {
+    public:
+        template <class F>
+        MapProcessor &with(F f) {
+            this->f = f;
+            return *this;
+        }
+        MapProcessor &ordered(size_t window=64) {
+            keep_order = true;
+            this->window = std::max(window, size_t(1));
+            return *this;
+        }
+    private:
+        std::function<OUT(IN)> f;
+        bool keep_order = false;
+        size_t window = 64;
+        std::mutex recv_lock;
+        std::mutex order_lock;
+        std::condition_variable order_changed;
+        std::atomic<uint64_t> received{0};
+        std::atomic<uint64_t> sent{0};
+        std::map<uint64_t, OUT> pending;
+        bool recv_next(IN &in, uint64_t &seq) {
+            std::lock_guard<std::mutex> guard(recv_lock);
+            if(!this->recv(in)) return false;
+            seq = received++;
+            return true;
+        }
+        // Waits until seq is inside the window, stores its result, and sends
+        // every result that is now in sequence.
+        bool emit(uint64_t seq, OUT &out) {
+            std::unique_lock<std::mutex> guard(order_lock);
+            order_changed.wait(guard, [&] { return seq < sent + window || !this->running; });
+            bool ok = this->running;
+            if(ok) {
+                pending.emplace(seq, std::move(out));
+                while(ok && pending.size() > 0 && pending.begin()->first == sent) {
+                    ok = this->send(pending.begin()->second);
+                    if(!ok) break;
+                    pending.erase(pending.begin());
+                    sent++;
+                }
+            }
+            order_changed.notify_all();
+            return ok;
+        }
+        void interrupt() {
+            std::lock_guard<std::mutex> guard(order_lock);
+            order_changed.notify_all();
+        }
+        void loop() {
+            try {
+                while(this->running) {
+                    IN in;
+                    uint64_t seq = 0;
+                    if(keep_order) {
+                        if(!recv_next(in, seq)) break;
+                    } else if(!this->recv(in)) {
+                        break;
+                    }
+                    OUT out = f(std::move(in));
+                    if(keep_order) {
+                        if(!emit(seq, out)) break;
+                    } else if(!this->send(out)) {
+                        break;
+                    }
+                }
+            } catch(...) {
+                this->fail(std::current_exception());
+                std::lock_guard<std::mutex> guard(order_lock);
+                order_changed.notify_all();
+            }
+        }
+        // In ordered mode, results move to the waiting outputs in sequence,
+        // and no input is taken while window results are outstanding.
+        bool poll() {
+            bool progress = this->flush();
+            if(this->nstalled > 0 || !accepting()) return progress;
+            IN in;
+            uint64_t seq = 0;
+            if(keep_order) {
+                std::lock_guard<std::mutex> guard(recv_lock);
+                if(!this->try_recv(in)) return progress;
+                seq = received++;
+            } else if(!this->try_recv(in)) {
+                return progress;
+            }
+            OUT out = f(std::move(in));
+            if(keep_order) {
+                std::lock_guard<std::mutex> guard(order_lock);
+                pending.emplace(seq, std::move(out));
+                while(pending.size() > 0 && pending.begin()->first == sent) {
+                    this->offer(pending.begin()->second);
+                    pending.erase(pending.begin());
+                    sent++;
+                }
+            } else {
+                this->offer(out);
+            }
+            return true;
+        }
+        bool accepting() {
+            return !keep_order || received < sent + window;
+        }
+        bool busy() {
+            std::lock_guard<std::mutex> guard(order_lock);
+            return pending.size() > 0;
+        }
+    };
+
+}